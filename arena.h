@@ -7,24 +7,70 @@
 #include <setjmp.h>
 #include <string.h>
 
+// header of a block chained to an arena once its initial memory runs out
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    // size of the whole mapping, including this header
+    ptrdiff_t size;
+} ArenaBlock;
+
 typedef struct {
+    // bounds of the current block, allocations move `end` down towards `beg`
     uint8_t *beg;
     uint8_t *end;
     uint8_t *limit;
 
+    // memory passed to `arena_init`, always used first
+    uint8_t *initial_beg;
+    uint8_t *initial_limit;
+
+    // mmap'ed blocks in order of use; the ones after `block` are spares
+    ArenaBlock *blocks;
+    // current block, NULL while in the initial memory
+    ArenaBlock *block;
+
+    // for returning spare blocks to the OS: number of the current block
+    // (0 = initial memory), the deepest one used since the last trim, and
+    // the number of clears since then
+    int32_t depth;
+    int32_t max_depth;
+    int32_t clears;
+
+    // bytes handed out since the last clear, including alignment padding
+    ptrdiff_t allocated;
+    // highest `allocated` since `arena_init` or `arena_reset_peak`, across
+    // clears, e.g. for measuring the footprint of an operation
+    ptrdiff_t peak;
+
     // jump buffer in case of OOM
     jmp_buf *oom;
 } Arena;
 
+// saved allocation state, see `arena_save`
+typedef struct {
+    ArenaBlock *block;
+    uint8_t *end;
+    int32_t depth;
+    ptrdiff_t allocated;
+} ArenaMark;
+
 enum {
     ARENA_SOFTFAIL = 1 << 0,
     ARENA_NOZERO = 1 << 1,
 };
 
+// minimum size of chained blocks
+#define ARENA_BLOCK_SIZE (1024 * 1024)
+// spare blocks not needed for this many clears are unmapped
+#define ARENA_TRIM_INTERVAL 1024
+
 void arena_init(Arena *arena, void *memory, ptrdiff_t size);
 void *arena_alloc(Arena *arena, ptrdiff_t size, ptrdiff_t align, ptrdiff_t count, uint32_t flags);
 void arena_free(void *context, void *ptr, ptrdiff_t size);
 void arena_clear(Arena *arena);
+ArenaMark arena_save(Arena *arena);
+void arena_restore(Arena *arena, ArenaMark mark);
+void arena_reset_peak(Arena *arena);
 
 #define ARENA_ALLOC(arena, type, count, flags) ((type *)  arena_alloc(arena, sizeof(type), __alignof__(type), count, flags))
 #define ARENA_ALLOC_ARRAY_EX(arena, type, count, flags) ARENA_ALLOC(arena, type, count, flags)
@@ -34,10 +80,13 @@ void arena_clear(Arena *arena);
 
 #endif /* ARENA_H */
 
-#ifdef ARENA_IMPLEMENTATION
+#if defined(ARENA_IMPLEMENTATION) && !defined(ARENA_IMPLEMENTED)
+#define ARENA_IMPLEMENTED
 
 #include <assert.h>
+#include <stdbool.h>
 #include <string.h>
+#include <sys/mman.h>
 
 static inline uintptr_t align_forward(uintptr_t start, ptrdiff_t align) {
     // `align` MUST be a power of two.
@@ -45,12 +94,64 @@ static inline uintptr_t align_forward(uintptr_t start, ptrdiff_t align) {
 }
 
 void arena_init(Arena *arena, void *memory, ptrdiff_t size) {
-    arena->beg = memory;
-    arena->end = arena->beg + size;
+    memset(arena, 0, sizeof(*arena));
+    arena->initial_beg = memory;
+    arena->initial_limit = arena->initial_beg + size;
+    arena->beg = arena->initial_beg;
+    arena->end = arena->initial_limit;
     arena->limit = arena->end;
     arena->oom = NULL;
 }
 
+static void
+arena_enter_block(Arena *arena, ArenaBlock *block) {
+    arena->block = block;
+    if (block) {
+        arena->beg = (uint8_t *) (block + 1);
+        arena->limit = (uint8_t *) block + block->size;
+    } else {
+        arena->beg = arena->initial_beg;
+        arena->limit = arena->initial_limit;
+    }
+    arena->end = arena->limit;
+}
+
+/**
+ * Continue in the next block which can hold `total` bytes at `align`,
+ * reusing spares or mapping a new one. Returns false if out of memory.
+ */
+static bool
+arena_grow(Arena *arena, ptrdiff_t total, ptrdiff_t align) {
+    ArenaBlock **next = arena->block ? &arena->block->next : &arena->blocks;
+    ptrdiff_t needed = sizeof(ArenaBlock) + total + align;
+
+    // spares which are too small are given back right away
+    while (*next && (*next)->size < needed) {
+        ArenaBlock *spare = *next;
+        *next = spare->next;
+        munmap(spare, spare->size);
+    }
+
+    if (!*next) {
+        ptrdiff_t size = align_forward(needed > ARENA_BLOCK_SIZE ? needed : ARENA_BLOCK_SIZE, 4096);
+        void *memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED) {
+            return false;
+        }
+        ArenaBlock *block = memory;
+        block->size = size;
+        block->next = NULL;
+        *next = block;
+    }
+
+    arena_enter_block(arena, *next);
+    arena->depth++;
+    if (arena->depth > arena->max_depth) {
+        arena->max_depth = arena->depth;
+    }
+    return true;
+}
+
 #if defined(__clang__) || defined(__GNUC__)
 __attribute__((malloc, alloc_size(2, 4), alloc_align(3)))
 #endif
@@ -58,17 +159,24 @@ void *arena_alloc(Arena *arena, ptrdiff_t size, ptrdiff_t align, ptrdiff_t count
     // `align` must be a power of two.
     ptrdiff_t total = size * count;
     ptrdiff_t avail = arena->end - arena->beg;
-    ptrdiff_t padding = -total & (align - 1);
+    ptrdiff_t padding = (uintptr_t) (arena->end - total) & (align - 1);
     if (total > avail - padding) {
-        if (flags & ARENA_SOFTFAIL) {
-            return NULL;
-        } else if (arena->oom) {
-            longjmp(*arena->oom, 1);
-        } else {
-            abort();
+        if (!arena_grow(arena, total, align)) {
+            if (flags & ARENA_SOFTFAIL) {
+                return NULL;
+            } else if (arena->oom) {
+                longjmp(*arena->oom, 1);
+            } else {
+                abort();
+            }
         }
+        padding = (uintptr_t) (arena->end - total) & (align - 1);
     }
     arena->end -= total + padding;
+    arena->allocated += total + padding;
+    if (arena->allocated > arena->peak) {
+        arena->peak = arena->allocated;
+    }
     void *result = arena->end;
     if (!(flags & ARENA_NOZERO)) {
         memset(result, 0, total);
@@ -76,8 +184,73 @@ void *arena_alloc(Arena *arena, ptrdiff_t size, ptrdiff_t align, ptrdiff_t count
     return result;
 }
 
+/**
+ * Give back the most recent allocation of `arena` (passed as `context`);
+ * frees of any other allocation are ignored.
+ */
+void arena_free(void *context, void *ptr, ptrdiff_t size) {
+    Arena *arena = context;
+    if ((uint8_t *) ptr == arena->end && arena->end + size <= arena->limit) {
+        arena->end += size;
+        arena->allocated -= size;
+    }
+}
+
+/**
+ * Release spare blocks beyond the deepest one used in the last
+ * `ARENA_TRIM_INTERVAL` clears.
+ */
+static void
+arena_trim(Arena *arena) {
+    ArenaBlock **it = &arena->blocks;
+    for (int32_t depth = 1; *it && depth <= arena->max_depth; depth++) {
+        it = &(*it)->next;
+    }
+    while (*it) {
+        ArenaBlock *spare = *it;
+        *it = spare->next;
+        munmap(spare, spare->size);
+    }
+    arena->clears = 0;
+    arena->max_depth = 0;
+}
+
 void arena_clear(Arena *arena) {
-    arena->end = arena->limit;
+    arena_enter_block(arena, NULL);
+    arena->depth = 0;
+    arena->allocated = 0;
+    if (++arena->clears >= ARENA_TRIM_INTERVAL) {
+        arena_trim(arena);
+    }
+}
+
+/**
+ * Save the allocation state, to throw away everything allocated after this
+ * point with `arena_restore`, e.g. at the end of a nested temporary scope.
+ */
+ArenaMark arena_save(Arena *arena) {
+    ArenaMark mark = {
+        .block = arena->block,
+        .end = arena->end,
+        .depth = arena->depth,
+        .allocated = arena->allocated,
+    };
+    return mark;
+}
+
+void arena_restore(Arena *arena, ArenaMark mark) {
+    // blocks entered after the mark are kept as spares
+    arena_enter_block(arena, mark.block);
+    arena->end = mark.end;
+    arena->depth = mark.depth;
+    arena->allocated = mark.allocated;
+}
+
+/**
+ * Start tracking `peak` anew from what is allocated right now.
+ */
+void arena_reset_peak(Arena *arena) {
+    arena->peak = arena->allocated;
 }
 
 #endif /* ARENA_IMPLEMENTATION */
@@ -0,0 +1,42 @@
+#ifndef BACKEND_H
+#define BACKEND_H
+
+#include <stdint.h>
+
+#include <pulse/pulseaudio.h>
+
+/**
+ * Everything the engine asks of the sound server, so that it can be served
+ * by something other than libpulse, e.g. when replaying traces or load
+ * testing against a simulated server. Callbacks follow libpulse's
+ * conventions and run from the main loop; other backends pass a NULL
+ * context.
+ */
+typedef struct AudioBackend {
+    void *userdata;
+
+    // Returns an operation handle, or NULL if the request couldn't be sent.
+    void *(*set_sink_input_volume)(struct AudioBackend *backend, uint32_t index,
+            const pa_cvolume *volume, pa_context_success_cb_t done, void *userdata);
+    // Release a handle after its callback ran.
+    void (*release)(struct AudioBackend *backend, void *op);
+    // Release a handle whose callback must not run anymore.
+    void (*cancel)(struct AudioBackend *backend, void *op);
+
+    // Info requests are fire and forget, the backend keeps track of them.
+    // List replies end with a call with eol = 1, like libpulse's.
+    void (*get_sink_input_info)(struct AudioBackend *backend, uint32_t index,
+            pa_sink_input_info_cb_t cb, void *userdata);
+    void (*get_sink_input_info_list)(struct AudioBackend *backend,
+            pa_sink_input_info_cb_t cb, void *userdata);
+    void (*get_client_info)(struct AudioBackend *backend, uint32_t index,
+            pa_client_info_cb_t cb, void *userdata);
+    void (*get_client_info_list)(struct AudioBackend *backend,
+            pa_client_info_cb_t cb, void *userdata);
+
+    // Deliver events of the facilities in `mask` to `cb`.
+    void (*subscribe)(struct AudioBackend *backend, pa_subscription_mask_t mask,
+            pa_context_subscribe_cb_t cb, void *userdata);
+} AudioBackend;
+
+#endif /* BACKEND_H */
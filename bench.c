@@ -0,0 +1,155 @@
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "procfixture.h"
+#include "process.h"
+#include "stats.h"
+
+#define ARENA_IMPLEMENTATION
+#include "arena.h"
+
+#define HASH_IMPLEMENTATION
+#include "hash.h"
+
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+typedef struct {
+    const char *name;
+    FixtureShape shape;
+    int32_t count;
+} Fixture;
+
+static const Fixture fixtures[] = {
+    { "chain-10k", FIXTURE_CHAIN, 10000 },
+    { "fan-10k", FIXTURE_FAN, 10000 },
+    { "tree-100k", FIXTURE_TREE, 100000 },
+};
+
+// operations timed per measurement, scaled down for the expensive ones
+#define BENCH_OPS 100000
+
+static void
+report(const Fixture *fixture, const char *what, uint64_t ns, int32_t ops, ptrdiff_t bytes) {
+    printf("%-10s %-20s %12.1f ns/op %12td bytes\n", fixture->name, what, (double) ns / ops, bytes);
+}
+
+// cheap reproducible PIDs of the fixture, so lookups don't follow a pattern
+static pid_t
+pick_pid(const Fixture *fixture, int32_t i) {
+    uint64_t x = (uint64_t) (i + 1) * 0xbf58476d1ce4e5b9;
+    return 1 + (pid_t) ((x >> 17) % (uint64_t) fixture->count);
+}
+
+/**
+ * Start measuring the memory of an operation on both arenas.
+ */
+static void
+begin_bytes(Arena *tree_arena, Arena *temp) {
+    arena_reset_peak(tree_arena);
+    arena_reset_peak(temp);
+}
+
+/**
+ * Memory of the operation since `begin_bytes`: the peaks of both arenas
+ * in the meantime, whether or not they were cleared since.
+ */
+static ptrdiff_t
+end_bytes(Arena *tree_arena, Arena *temp) {
+    return tree_arena->peak + temp->peak;
+}
+
+static void
+bench_fixture(const Fixture *fixture, Arena *tree_arena, Arena *temp) {
+    // start from empty arenas, not with the previous fixture's tree
+    arena_clear(tree_arena);
+    arena_clear(temp);
+    ProcessTree tree;
+    process_tree_init(&tree, tree_arena);
+
+    int32_t scans = MAX(3, BENCH_OPS / fixture->count / 4);
+    begin_bytes(tree_arena, temp);
+    uint64_t start = stats_now();
+    for (int32_t i = 0; i < scans; i++) {
+        process_tree_rescan(&tree);
+    }
+    report(fixture, "rescan", stats_now() - start, scans, end_bytes(tree_arena, temp));
+
+    int32_t walks_in_memory = MAX(10, BENCH_OPS / fixture->count * 10);
+    begin_bytes(tree_arena, temp);
+    start = stats_now();
+    for (int32_t i = 0; i < walks_in_memory; i++) {
+        arena_clear(temp);
+        pid_t *children;
+        process_tree_get_descendants(&tree, temp, 1, &children);
+    }
+    report(fixture, "get_descendants(1)", stats_now() - start, walks_in_memory, end_bytes(tree_arena, temp));
+
+    arena_clear(temp);
+    begin_bytes(tree_arena, temp);
+    start = stats_now();
+    for (int32_t i = 0; i < BENCH_OPS; i++) {
+        arena_clear(temp);
+        pid_t *children;
+        process_tree_get_descendants(&tree, temp, pick_pid(fixture, i), &children);
+    }
+    report(fixture, "get_descendants(rand)", stats_now() - start, BENCH_OPS, end_bytes(tree_arena, temp));
+
+    // chains need room for all of their ancestors
+    int32_t capacity = fixture->shape == FIXTURE_CHAIN ? fixture->count + 1 : 256;
+    int32_t lookups = fixture->shape == FIXTURE_CHAIN ? BENCH_OPS / 100 : BENCH_OPS;
+    pid_t *ancestors = malloc(capacity * sizeof(*ancestors));
+    arena_clear(temp);
+    begin_bytes(tree_arena, temp);
+    start = stats_now();
+    for (int32_t i = 0; i < lookups; i++) {
+        process_tree_get_ancestors(&tree, pick_pid(fixture, i), ancestors, capacity);
+    }
+    report(fixture, "get_ancestors", stats_now() - start, lookups, end_bytes(tree_arena, temp));
+    free(ancestors);
+
+    // fork/exit churn of short-lived processes, including compactions
+    begin_bytes(tree_arena, temp);
+    start = stats_now();
+    for (int32_t i = 0; i < BENCH_OPS; i++) {
+        pid_t pid = fixture->count + 1 + i;
+        process_tree_add(&tree, pid, pick_pid(fixture, i));
+        process_tree_remove(&tree, pid);
+    }
+    report(fixture, "add+remove", stats_now() - start, BENCH_OPS, end_bytes(tree_arena, temp));
+}
+
+int
+main(int argc, char *argv[]) {
+    const char *base = argc > 1 ? argv[1] : getenv("TMPDIR");
+    char root[4096];
+    snprintf(root, sizeof(root), "%s/procfixture.XXXXXX", base ? base : "/tmp");
+
+    size_t arena_size = 1024 * 1024;
+    Arena tree_arena;
+    arena_init(&tree_arena, calloc(arena_size, 1), arena_size);
+    Arena temp;
+    arena_init(&temp, calloc(arena_size, 1), arena_size);
+
+    for (size_t i = 0; i < sizeof(fixtures) / sizeof(fixtures[0]); i++) {
+        const Fixture *fixture = &fixtures[i];
+        char path[4096];
+        snprintf(path, sizeof(path), "%s", root);
+        if (!mkdtemp(path)) {
+            perror("mkdtemp");
+            return 1;
+        }
+        if (!proc_fixture_build(path, fixture->shape, fixture->count)
+                || !process_set_root(path)) {
+            fprintf(stderr, "failed to build fixture in %s\n", path);
+            proc_fixture_remove(path);
+            return 1;
+        }
+        bench_fixture(fixture, &tree_arena, &temp);
+        proc_fixture_remove(path);
+    }
+    return 0;
+}
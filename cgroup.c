@@ -0,0 +1,254 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+#include "hash.h"
+#include "cgroup.h"
+
+// initial sizes of the hashtables, both grow as needed
+#define CGROUP_INITIAL_EXP 6
+#define CGROUP_PID_INITIAL_EXP 8
+
+// enough for all hierarchies of a hybrid setup
+#define CGROUP_FILE_SIZE 4096
+
+/**
+ * 64-bit FNV-1a, for looking up interned paths.
+ */
+static uint64_t
+hash_string(const char *s, size_t len) {
+    uint64_t hash = 0xcbf29ce484222325;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (uint8_t) s[i];
+        hash *= 0x100000001b3;
+    }
+    return hash;
+}
+
+static bool
+has_suffix(const char *s, size_t len, const char *suffix) {
+    size_t suffix_len = strlen(suffix);
+    return len >= suffix_len && memcmp(s + len - suffix_len, suffix, suffix_len) == 0;
+}
+
+/**
+ * Whether the cgroup with the last path component `leaf` holds a single
+ * application: systemd puts launched applications into scopes or services
+ * of their own (app-*.scope, snap.*.scope, app-flatpak-*.scope, ...), but
+ * everything started from a login session shares its session scope.
+ */
+static bool
+is_own_cgroup(const char *leaf, size_t len) {
+    if (has_suffix(leaf, len, ".scope")) {
+        return !(len >= 8 && memcmp(leaf, "session-", 8) == 0)
+            && !(len == 10 && memcmp(leaf, "init.scope", 10) == 0);
+    }
+    return has_suffix(leaf, len, ".service") && !(len >= 5 && memcmp(leaf, "user@", 5) == 0);
+}
+
+void
+cgroup_cache_init(CgroupCache *cache) {
+    memset(cache, 0, sizeof(*cache));
+    hash_map_init(&cache->by_path, CGROUP_INITIAL_EXP);
+    hash_map_init(&cache->by_pid, CGROUP_PID_INITIAL_EXP);
+    cache->watch_fd = -1;
+}
+
+static void
+watch_directory(CgroupCache *cache, const char *path, size_t len, uint32_t mask) {
+    char full[PATH_MAX];
+    int n = snprintf(full, sizeof(full), "%s%.*s", cache->mount_path, (int) len, path);
+    if (n < 0 || (size_t) n >= sizeof(full)) {
+        return;
+    }
+    int wd = inotify_add_watch(cache->watch_fd, full, mask);
+    // the same directory yields the same descriptor
+    if (wd >= 0 && !hash_map_get(&cache->watch_paths, (uint32_t) wd)) {
+        char *copy = strndup(path, len);
+        assert(copy);
+        hash_map_put(&cache->watch_paths, (uint32_t) wd, copy);
+    }
+}
+
+/**
+ * Watch the parent of `cgroup` for sibling scopes coming and going, which
+ * is where systemd creates the scopes of newly launched applications.
+ */
+static void
+watch_cgroup(CgroupCache *cache, const Cgroup *cgroup) {
+    const char *slash = strrchr(cgroup->path, '/');
+    size_t len = slash ? (size_t) (slash - cgroup->path) : 0;
+    watch_directory(cache, cgroup->path, len, IN_CREATE | IN_DELETE | IN_ONLYDIR);
+}
+
+static const Cgroup *
+intern_cgroup(CgroupCache *cache, const char *path, size_t len) {
+    uint64_t hash = hash_string(path, len);
+    Cgroup *first = hash_map_get(&cache->by_path, hash);
+    for (Cgroup *it = first; it; it = it->next_same_hash) {
+        if (strncmp(it->path, path, len) == 0 && !it->path[len]) {
+            return it;
+        }
+    }
+
+    Cgroup *cgroup = calloc(1, sizeof(*cgroup));
+    assert(cgroup);
+    cgroup->path = strndup(path, len);
+    assert(cgroup->path);
+    if (cache->num_cgroups == cache->cgroup_capacity) {
+        cache->cgroup_capacity = cache->cgroup_capacity ? 2 * cache->cgroup_capacity : 16;
+        cache->cgroups = realloc(cache->cgroups, cache->cgroup_capacity * sizeof(*cache->cgroups));
+        assert(cache->cgroups);
+    }
+    cache->cgroups[cache->num_cgroups] = cgroup;
+    cgroup->id = ++cache->num_cgroups;
+    const char *slash = memrchr(path, '/', len);
+    const char *leaf = slash ? slash + 1 : path;
+    cgroup->own = is_own_cgroup(leaf, len - (leaf - path));
+    cgroup->next_same_hash = first;
+    hash_map_put(&cache->by_path, hash, cgroup);
+    if (cache->watch_fd >= 0) {
+        watch_cgroup(cache, cgroup);
+    }
+    return cgroup;
+}
+
+/**
+ * Find the path in the contents of /proc/<pid>/cgroup: that of the unified
+ * hierarchy (`0::/path`) if there is one, otherwise that of systemd's named
+ * hierarchy on legacy setups.
+ */
+static bool
+parse_cgroup_path(const char *buffer, size_t size, const char **path, size_t *len) {
+    bool found = false;
+    for (const char *line = buffer; line < buffer + size;) {
+        const char *end = memchr(line, '\n', buffer + size - line);
+        if (!end) {
+            end = buffer + size;
+        }
+        const char *first = memchr(line, ':', end - line);
+        const char *second = first ? memchr(first + 1, ':', end - first - 1) : NULL;
+        if (second) {
+            bool unified = first == line + 1 && line[0] == '0' && second == first + 1;
+            bool systemd = second - first - 1 == 12 && memcmp(first + 1, "name=systemd", 12) == 0;
+            if (unified || (systemd && !found)) {
+                *path = second + 1;
+                *len = end - *path;
+                found = true;
+                if (unified) {
+                    return true;
+                }
+            }
+        }
+        line = end + 1;
+    }
+    return found;
+}
+
+const Cgroup *
+cgroup_of(CgroupCache *cache, pid_t pid) {
+    const Cgroup *cgroup = hash_map_get(&cache->by_pid, (uint32_t) pid);
+    if (cgroup) {
+        return cgroup;
+    }
+
+    char name[32];
+    snprintf(name, sizeof(name), "/proc/%d/cgroup", pid);
+    int fd = open(name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+    char buffer[CGROUP_FILE_SIZE];
+    ssize_t size = read(fd, buffer, sizeof(buffer));
+    close(fd);
+
+    const char *path = NULL;
+    size_t len = 0;
+    if (size <= 0 || !parse_cgroup_path(buffer, size, &path, &len)) {
+        return NULL;
+    }
+    cgroup = intern_cgroup(cache, path, len);
+    hash_map_put(&cache->by_pid, (uint32_t) pid, (void *) cgroup);
+    return cgroup;
+}
+
+void
+cgroup_cache_forget(CgroupCache *cache, pid_t pid) {
+    hash_map_remove(&cache->by_pid, (uint32_t) pid);
+}
+
+void
+cgroup_cache_clear(CgroupCache *cache) {
+    free(cache->by_pid.slots);
+    hash_map_init(&cache->by_pid, CGROUP_PID_INITIAL_EXP);
+}
+
+int
+cgroup_watch_open(CgroupCache *cache) {
+    if (cache->watch_fd >= 0) {
+        return cache->watch_fd;
+    }
+    if (access("/sys/fs/cgroup/cgroup.controllers", F_OK) == 0) {
+        cache->mount_path = "/sys/fs/cgroup";
+    } else if (access("/sys/fs/cgroup/unified/cgroup.controllers", F_OK) == 0) {
+        cache->mount_path = "/sys/fs/cgroup/unified";
+    } else if (access("/sys/fs/cgroup/systemd", F_OK) == 0) {
+        cache->mount_path = "/sys/fs/cgroup/systemd";
+    } else {
+        return -1;
+    }
+
+    cache->watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (cache->watch_fd < 0) {
+        return -1;
+    }
+    hash_map_init(&cache->watch_paths, CGROUP_INITIAL_EXP);
+    for (uint32_t i = 0; i < cache->num_cgroups; i++) {
+        watch_cgroup(cache, cache->cgroups[i]);
+    }
+    return cache->watch_fd;
+}
+
+bool
+cgroup_watch_dispatch(CgroupCache *cache) {
+    bool changed = false;
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    for (;;) {
+        ssize_t len = read(cache->watch_fd, buffer, sizeof(buffer));
+        if (len <= 0) {
+            break;
+        }
+        for (char *it = buffer; it < buffer + len;) {
+            struct inotify_event *event = (struct inotify_event *) it;
+            it += sizeof(*event) + event->len;
+
+            char *dir = hash_map_get(&cache->watch_paths, (uint32_t) event->wd);
+            if (event->mask & IN_IGNORED) {
+                free(hash_map_remove(&cache->watch_paths, (uint32_t) event->wd));
+                continue;
+            }
+            changed = true;
+            if (dir && (event->mask & IN_CREATE) && (event->mask & IN_ISDIR) && event->len) {
+                // a new scope is created empty and its processes are moved
+                // in afterwards, which only shows as a change of its
+                // populated state
+                char path[PATH_MAX];
+                int n = snprintf(path, sizeof(path), "%s/%s/cgroup.events", dir, event->name);
+                if (n > 0 && (size_t) n < sizeof(path)) {
+                    watch_directory(cache, path, n, IN_MODIFY);
+                }
+            }
+        }
+    }
+    if (changed) {
+        cgroup_cache_clear(cache);
+    }
+    return changed;
+}
@@ -0,0 +1,81 @@
+#ifndef CGROUP_H
+#define CGROUP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "hash.h"
+
+/**
+ * Interned cgroup path; lives as long as the cache, so pointers to it can
+ * be held by sink inputs.
+ */
+typedef struct Cgroup {
+    // relative to the cgroup mount, e.g. /user.slice/.../app-firefox-1234.scope
+    char *path;
+    // further cgroups whose paths have the same hash
+    struct Cgroup *next_same_hash;
+    // small unique number, for keying hashtables
+    uint32_t id;
+    // whether the cgroup belongs to a single application, i.e. a systemd
+    // scope or service other than a login session; shared ones such as
+    // session scopes can't tell applications apart
+    bool own;
+} Cgroup;
+
+typedef struct {
+    // path hash -> Cgroup*, colliding ones linked via `next_same_hash`
+    HashMap by_path;
+    // all interned cgroups, by id - 1
+    Cgroup **cgroups;
+    uint32_t num_cgroups;
+    uint32_t cgroup_capacity;
+    // PID -> Cgroup*, filled on first lookup
+    HashMap by_pid;
+
+    // inotify instance watching the directories of interned cgroups, -1 if
+    // not watching
+    int watch_fd;
+    // watch descriptor -> watched path, relative to `mount_path`
+    HashMap watch_paths;
+    // where the hierarchy of the parsed paths is mounted
+    const char *mount_path;
+} CgroupCache;
+
+void cgroup_cache_init(CgroupCache *cache);
+
+/**
+ * Returns the cgroup of `pid`, read from /proc/<pid>/cgroup on the first
+ * call and cached afterwards, or NULL if it can't be read, e.g. because the
+ * process exited.
+ */
+const Cgroup *cgroup_of(CgroupCache *cache, pid_t pid);
+
+/**
+ * Drop the cached cgroup of `pid`, e.g. after the process exited and its
+ * PID may get reused.
+ */
+void cgroup_cache_forget(CgroupCache *cache, pid_t pid);
+
+/**
+ * Drop all cached PIDs, e.g. after processes may have been moved to other
+ * cgroups. Interned cgroups stay valid.
+ */
+void cgroup_cache_clear(CgroupCache *cache);
+
+/**
+ * Watch the cgroup tree around interned cgroups for scopes being created or
+ * removed. Returns a non-blocking inotify descriptor, or -1 if inotify is
+ * unavailable.
+ */
+int cgroup_watch_open(CgroupCache *cache);
+
+/**
+ * Consume pending inotify events. Returns true if the cgroup tree changed,
+ * in which case the cache was cleared and cgroups of PIDs should be looked
+ * up again.
+ */
+bool cgroup_watch_dispatch(CgroupCache *cache);
+
+#endif /* CGROUP_H */
@@ -0,0 +1,171 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stdint.h>
+
+/**
+ * Mask-step-index (MSI) lookup for open addressing with double hashing.
+ * Returns the next slot to probe in a table of `1 << exp` slots, starting
+ * from `index`, which should initially be the hash itself.
+ */
+static inline int32_t
+ht_lookup(uint64_t hash, int exp, int32_t index) {
+    uint32_t mask = ((uint32_t)1 << exp) - 1;
+    uint32_t step = (hash >> (64 - exp)) | 1;
+    return (index + step) & mask;
+}
+
+/**
+ * Integer mixer (splitmix64 finalizer), so that all bits of the hash,
+ * including the top ones used as MSI step, depend on all bits of `x`.
+ */
+static inline uint64_t
+hash_u64(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111eb;
+    x ^= x >> 31;
+    return x;
+}
+
+typedef struct {
+    uint64_t key;
+    // NULL for empty slots
+    void *value;
+} HashMapSlot;
+
+/**
+ * Growable MSI hashtable mapping integer keys to non-NULL pointers, with
+ * tombstones for removed entries.
+ */
+typedef struct {
+    HashMapSlot *slots;
+    int exp;
+    int32_t count;
+    // live entries plus tombstones
+    int32_t used;
+} HashMap;
+
+void hash_map_init(HashMap *map, int exp);
+void *hash_map_get(HashMap *map, uint64_t key);
+void hash_map_put(HashMap *map, uint64_t key, void *value);
+void *hash_map_remove(HashMap *map, uint64_t key);
+
+#endif /* HASH_H */
+
+#if defined(HASH_IMPLEMENTATION) && !defined(HASH_IMPLEMENTED)
+#define HASH_IMPLEMENTED
+
+#include <assert.h>
+#include <stdlib.h>
+
+// marks removed entries
+#define HASH_MAP_TOMBSTONE ((void *) 1)
+
+void
+hash_map_init(HashMap *map, int exp) {
+    map->exp = exp;
+    map->count = 0;
+    map->used = 0;
+    map->slots = calloc((size_t)1 << exp, sizeof(*map->slots));
+    assert(map->slots);
+}
+
+/**
+ * Rebuild the table without tombstones, growing it if it is more than half
+ * full.
+ */
+static void
+hash_map_rehash(HashMap *map) {
+    int exp = map->exp;
+    if (map->count * 2 >= ((int32_t)1 << exp)) {
+        exp++;
+    }
+
+    HashMapSlot *slots = calloc((size_t)1 << exp, sizeof(*slots));
+    assert(slots);
+    for (int32_t i = 0; i < ((int32_t)1 << map->exp); i++) {
+        HashMapSlot *slot = &map->slots[i];
+        if (slot->value && slot->value != HASH_MAP_TOMBSTONE) {
+            uint64_t hash = hash_u64(slot->key);
+            int32_t index = (int32_t) hash;
+            do {
+                index = ht_lookup(hash, exp, index);
+            } while (slots[index].value);
+            slots[index] = *slot;
+        }
+    }
+
+    free(map->slots);
+    map->slots = slots;
+    map->exp = exp;
+    map->used = map->count;
+}
+
+static int32_t
+hash_map_find(HashMap *map, uint64_t key) {
+    uint64_t hash = hash_u64(key);
+    for (int32_t index = (int32_t) hash;;) {
+        index = ht_lookup(hash, map->exp, index);
+        HashMapSlot *slot = &map->slots[index];
+        if (!slot->value) {
+            return -1;
+        } else if (slot->value != HASH_MAP_TOMBSTONE && slot->key == key) {
+            return index;
+        }
+    }
+}
+
+void *
+hash_map_get(HashMap *map, uint64_t key) {
+    int32_t index = hash_map_find(map, key);
+    return (index >= 0) ? map->slots[index].value : NULL;
+}
+
+void
+hash_map_put(HashMap *map, uint64_t key, void *value) {
+    assert(value && value != HASH_MAP_TOMBSTONE);
+    if ((map->used + 1) * 4 > ((int32_t)1 << map->exp) * 3) {
+        hash_map_rehash(map);
+    }
+
+    uint64_t hash = hash_u64(key);
+    int32_t tombstone = -1;
+    for (int32_t index = (int32_t) hash;;) {
+        index = ht_lookup(hash, map->exp, index);
+        HashMapSlot *slot = &map->slots[index];
+        if (!slot->value) {
+            if (tombstone >= 0) {
+                slot = &map->slots[tombstone];
+            } else {
+                map->used++;
+            }
+            slot->key = key;
+            slot->value = value;
+            map->count++;
+            return;
+        } else if (slot->value == HASH_MAP_TOMBSTONE) {
+            if (tombstone < 0) {
+                tombstone = index;
+            }
+        } else if (slot->key == key) {
+            slot->value = value;
+            return;
+        }
+    }
+}
+
+void *
+hash_map_remove(HashMap *map, uint64_t key) {
+    int32_t index = hash_map_find(map, key);
+    if (index < 0) {
+        return NULL;
+    }
+    void *value = map->slots[index].value;
+    map->slots[index].value = HASH_MAP_TOMBSTONE;
+    map->count--;
+    return value;
+}
+
+#endif /* HASH_IMPLEMENTATION */
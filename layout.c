@@ -0,0 +1,139 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "layout.h"
+
+static inline float
+clampf(float x, float lo, float hi) {
+    if (x < lo) return lo;
+    if (x > hi) return hi;
+    return x;
+}
+
+void
+layout_init(Layout *layout) {
+    memset(layout, 0, sizeof(*layout));
+    Monitor monitors[2] = {
+        { .x = 0, .y = 0, .width = 1920, .height = 1080 },
+        { .x = 1920, .y = 0, .width = 1920, .height = 1080 },
+    };
+    layout_set_monitors(layout, monitors, 2);
+}
+
+bool
+layout_parse_mappings(Layout *layout, const char *spec) {
+    while (*spec) {
+        if (layout->num_mappings == LAYOUT_MAX_MONITORS) {
+            return false;
+        }
+        SpeakerMapping *mapping = &layout->mappings[layout->num_mappings];
+
+        const char *equals = strchr(spec, '=');
+        if (!equals || equals == spec || equals - spec >= LAYOUT_MAX_NAME) {
+            return false;
+        }
+        memcpy(mapping->name, spec, equals - spec);
+        mapping->name[equals - spec] = '\0';
+
+        char *end;
+        mapping->left = strtof(equals + 1, &end);
+        if (end == equals + 1 || *end != ':') {
+            return false;
+        }
+        const char *right = end + 1;
+        mapping->right = strtof(right, &end);
+        if (end == right || (*end != ',' && *end != '\0')) {
+            return false;
+        }
+        mapping->left = clampf(mapping->left, 0.0f, 1.0f);
+        mapping->right = clampf(mapping->right, 0.0f, 1.0f);
+
+        layout->num_mappings++;
+        spec = *end == ',' ? end + 1 : end;
+    }
+    return true;
+}
+
+void
+layout_set_monitors(Layout *layout, const Monitor *monitors, int32_t count) {
+    if (count > LAYOUT_MAX_MONITORS) {
+        count = LAYOUT_MAX_MONITORS;
+    }
+    memcpy(layout->monitors, monitors, count * sizeof(*monitors));
+    layout->num_monitors = count;
+
+    layout->min_x = 0;
+    layout->max_x = 0;
+    for (int32_t i = 0; i < count; i++) {
+        Monitor *monitor = &layout->monitors[i];
+        int32_t right = monitor->x + monitor->width;
+        if (i == 0 || monitor->x < layout->min_x) {
+            layout->min_x = monitor->x;
+        }
+        if (i == 0 || right > layout->max_x) {
+            layout->max_x = right;
+        }
+
+        monitor->mapped = false;
+        for (int32_t j = 0; j < layout->num_mappings; j++) {
+            if (strcmp(layout->mappings[j].name, monitor->name) == 0) {
+                monitor->mapped = true;
+                monitor->left = layout->mappings[j].left;
+                monitor->right = layout->mappings[j].right;
+                break;
+            }
+        }
+    }
+}
+
+/**
+ * Monitor containing the point (x, y), or the closest one if it lies in a
+ * gap between monitors or off screen.
+ */
+static const Monitor *
+find_monitor(const Layout *layout, float x, float y) {
+    const Monitor *closest = NULL;
+    float closest_distance = 0.0f;
+    for (int32_t i = 0; i < layout->num_monitors; i++) {
+        const Monitor *monitor = &layout->monitors[i];
+        float dx = clampf(x, monitor->x, monitor->x + monitor->width) - x;
+        float dy = clampf(y, monitor->y, monitor->y + monitor->height) - y;
+        float distance = dx * dx + dy * dy;
+        if (distance == 0.0f) {
+            return monitor;
+        }
+        if (!closest || distance < closest_distance) {
+            closest = monitor;
+            closest_distance = distance;
+        }
+    }
+    return closest;
+}
+
+void
+layout_position(const Layout *layout, int32_t x, int32_t y, int32_t width, int32_t height,
+        float *balance, float *front)
+{
+    float center_x = (float) x + (float) width / 2.0f;
+    float center_y = (float) y + (float) height / 2.0f;
+    const Monitor *monitor = find_monitor(layout, center_x, center_y);
+
+    *front = 0.5f;
+    if (monitor && monitor->height > 0) {
+        *front = clampf(1.0f - (center_y - monitor->y) / monitor->height, 0.0f, 1.0f);
+    }
+
+    if (monitor && monitor->mapped && monitor->width > 0) {
+        float t = clampf((center_x - monitor->x) / monitor->width, 0.0f, 1.0f);
+        *balance = monitor->left + t * (monitor->right - monitor->left);
+        return;
+    }
+
+    int32_t desktop_width = layout->max_x - layout->min_x;
+    if (desktop_width <= 0) {
+        *balance = 0.5f;
+        return;
+    }
+    *balance = clampf((center_x - layout->min_x) / desktop_width, 0.0f, 1.0f);
+}
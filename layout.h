@@ -0,0 +1,74 @@
+#ifndef LAYOUT_H
+#define LAYOUT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define LAYOUT_MAX_MONITORS 16
+#define LAYOUT_MAX_NAME 32
+
+typedef struct {
+    int32_t x;
+    int32_t y;
+    int32_t width;
+    int32_t height;
+    // output name, e.g. "DP-1", to match speaker mappings against
+    char name[LAYOUT_MAX_NAME];
+
+    // whether a speaker mapping applies, and the balance at the left and
+    // right edge if so
+    bool mapped;
+    float left;
+    float right;
+} Monitor;
+
+typedef struct {
+    char name[LAYOUT_MAX_NAME];
+    float left;
+    float right;
+} SpeakerMapping;
+
+/**
+ * Monitor geometry, cached so that computing a balance takes no X requests.
+ * Windows pan across the whole desktop width, except on monitors with a
+ * speaker mapping, which pan within their own range.
+ */
+typedef struct {
+    Monitor monitors[LAYOUT_MAX_MONITORS];
+    int32_t num_monitors;
+    // horizontal extent of the desktop
+    int32_t min_x;
+    int32_t max_x;
+
+    SpeakerMapping mappings[LAYOUT_MAX_MONITORS];
+    int32_t num_mappings;
+} Layout;
+
+/**
+ * Initialize `layout` with two 1920x1080 monitors side by side, until the
+ * real ones are known.
+ */
+void layout_init(Layout *layout);
+
+/**
+ * Add speaker mappings from `spec`, a comma-separated list of
+ * NAME=LEFT:RIGHT, where LEFT and RIGHT are the balance from 0 (only left)
+ * to 1 (only right) at the edges of the monitor NAME. Returns false if
+ * `spec` is malformed.
+ */
+bool layout_parse_mappings(Layout *layout, const char *spec);
+
+/**
+ * Replace the monitors of `layout`, at most LAYOUT_MAX_MONITORS of them.
+ */
+void layout_set_monitors(Layout *layout, const Monitor *monitors, int32_t count);
+
+/**
+ * Position of the center of a window with the given geometry: `balance`
+ * from 0.0f (only left) to 1.0f (only right), and `front` from 0.0f at the
+ * bottom to 1.0f at the top of the monitor it is on.
+ */
+void layout_position(const Layout *layout, int32_t x, int32_t y, int32_t width, int32_t height,
+        float *balance, float *front);
+
+#endif /* LAYOUT_H */
@@ -0,0 +1,382 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mock.h"
+
+typedef struct {
+    bool used;
+    uint32_t client;
+    pa_cvolume volume;
+    pa_proplist *proplist;
+} MockSinkInput;
+
+typedef struct {
+    bool used;
+    pa_proplist *proplist;
+} MockClient;
+
+typedef enum {
+    REPLY_VOLUME,
+    REPLY_SINK_INPUT,
+    REPLY_SINK_INPUT_LIST,
+    REPLY_CLIENT,
+    REPLY_CLIENT_LIST,
+    REPLY_EVENT,
+} ReplyType;
+
+/**
+ * A reply or event waiting for its latency to pass. Volume replies double
+ * as operation handles, freed once released or cancelled.
+ */
+typedef struct {
+    MockServer *server;
+    ReplyType type;
+    uint32_t index;
+    union {
+        pa_context_success_cb_t success;
+        pa_sink_input_info_cb_t sink_input;
+        pa_client_info_cb_t client;
+    } cb;
+    void *userdata;
+    pa_subscription_event_type_t event;
+    pa_time_event *timer;
+} MockReply;
+
+struct MockServer {
+    pa_mainloop_api *api;
+    pa_usec_t latency;
+
+    // indexed by sink input and client index, which are never reused
+    MockSinkInput *sink_inputs;
+    uint32_t num_sink_inputs;
+    uint32_t sink_input_capacity;
+    MockClient *clients;
+    uint32_t num_clients;
+    uint32_t client_capacity;
+
+    pa_subscription_mask_t mask;
+    pa_context_subscribe_cb_t subscribe_cb;
+    void *subscribe_userdata;
+
+    MockStats stats;
+};
+
+static void deliver_reply(pa_mainloop_api *api, pa_time_event *e, const struct timeval *tv, void *userdata);
+
+static MockReply *
+schedule_reply(MockServer *server, ReplyType type, uint32_t index, void *userdata) {
+    MockReply *reply = calloc(1, sizeof(*reply));
+    assert(reply);
+    reply->server = server;
+    reply->type = type;
+    reply->index = index;
+    reply->userdata = userdata;
+
+    struct timeval tv;
+    pa_timeval_add(pa_gettimeofday(&tv), server->latency);
+    reply->timer = server->api->time_new(server->api, &tv, deliver_reply, reply);
+    assert(reply->timer);
+    return reply;
+}
+
+static void
+emit_event(MockServer *server, pa_subscription_event_type_t event, uint32_t index) {
+    pa_subscription_mask_t bit = 1 << (event & PA_SUBSCRIPTION_EVENT_FACILITY_MASK);
+    if (server->subscribe_cb && (server->mask & bit)) {
+        MockReply *reply = schedule_reply(server, REPLY_EVENT, index, server->subscribe_userdata);
+        reply->event = event;
+        server->stats.events++;
+    }
+}
+
+static MockSinkInput *
+get_sink_input(MockServer *server, uint32_t index) {
+    if (index < server->num_sink_inputs && server->sink_inputs[index].used) {
+        return &server->sink_inputs[index];
+    }
+    return NULL;
+}
+
+static MockClient *
+get_client(MockServer *server, uint32_t index) {
+    if (index < server->num_clients && server->clients[index].used) {
+        return &server->clients[index];
+    }
+    return NULL;
+}
+
+static void
+fill_sink_input_info(MockServer *server, uint32_t index, pa_sink_input_info *info) {
+    MockSinkInput *input = &server->sink_inputs[index];
+    memset(info, 0, sizeof(*info));
+    info->index = index;
+    info->name = "mock";
+    info->client = input->client;
+    info->sample_spec.format = PA_SAMPLE_FLOAT32LE;
+    info->sample_spec.rate = 48000;
+    info->sample_spec.channels = input->volume.channels;
+    pa_channel_map_init_auto(&info->channel_map, input->volume.channels, PA_CHANNEL_MAP_DEFAULT);
+    info->volume = input->volume;
+    info->proplist = input->proplist;
+    info->has_volume = 1;
+    info->volume_writable = 1;
+}
+
+static void
+fill_client_info(MockServer *server, uint32_t index, pa_client_info *info) {
+    memset(info, 0, sizeof(*info));
+    info->index = index;
+    info->name = "mock";
+    info->proplist = server->clients[index].proplist;
+}
+
+static void
+deliver_reply(pa_mainloop_api *api, pa_time_event *e, const struct timeval *tv, void *userdata) {
+    (void) tv;
+    MockReply *reply = userdata;
+    MockServer *server = reply->server;
+    api->time_free(e);
+    reply->timer = NULL;
+
+    switch (reply->type) {
+        case REPLY_VOLUME: {
+            MockSinkInput *input = get_sink_input(server, reply->index);
+            server->stats.in_flight--;
+            if (input) {
+                emit_event(server, PA_SUBSCRIPTION_EVENT_SINK_INPUT | PA_SUBSCRIPTION_EVENT_CHANGE, reply->index);
+            }
+            // freed on release
+            reply->cb.success(NULL, input != NULL, reply->userdata);
+            return;
+        }
+        case REPLY_SINK_INPUT: {
+            pa_sink_input_info info;
+            if (get_sink_input(server, reply->index)) {
+                fill_sink_input_info(server, reply->index, &info);
+                reply->cb.sink_input(NULL, &info, 0, reply->userdata);
+                reply->cb.sink_input(NULL, NULL, 1, reply->userdata);
+            } else {
+                reply->cb.sink_input(NULL, NULL, -1, reply->userdata);
+            }
+            break;
+        }
+        case REPLY_SINK_INPUT_LIST: {
+            pa_sink_input_info info;
+            for (uint32_t i = 0; i < server->num_sink_inputs; i++) {
+                if (server->sink_inputs[i].used) {
+                    fill_sink_input_info(server, i, &info);
+                    reply->cb.sink_input(NULL, &info, 0, reply->userdata);
+                }
+            }
+            reply->cb.sink_input(NULL, NULL, 1, reply->userdata);
+            break;
+        }
+        case REPLY_CLIENT: {
+            pa_client_info info;
+            if (get_client(server, reply->index)) {
+                fill_client_info(server, reply->index, &info);
+                reply->cb.client(NULL, &info, 0, reply->userdata);
+                reply->cb.client(NULL, NULL, 1, reply->userdata);
+            } else {
+                reply->cb.client(NULL, NULL, -1, reply->userdata);
+            }
+            break;
+        }
+        case REPLY_CLIENT_LIST: {
+            pa_client_info info;
+            for (uint32_t i = 0; i < server->num_clients; i++) {
+                if (server->clients[i].used) {
+                    fill_client_info(server, i, &info);
+                    reply->cb.client(NULL, &info, 0, reply->userdata);
+                }
+            }
+            reply->cb.client(NULL, NULL, 1, reply->userdata);
+            break;
+        }
+        case REPLY_EVENT:
+            if (server->subscribe_cb) {
+                server->subscribe_cb(NULL, reply->event, reply->index, reply->userdata);
+            }
+            break;
+    }
+    free(reply);
+}
+
+static void *
+mock_set_sink_input_volume(AudioBackend *backend, uint32_t index,
+        const pa_cvolume *volume, pa_context_success_cb_t done, void *userdata)
+{
+    MockServer *server = backend->userdata;
+    MockSinkInput *input = get_sink_input(server, index);
+    if (input) {
+        // applied right away, only the reply is late
+        input->volume = *volume;
+    }
+
+    MockReply *reply = schedule_reply(server, REPLY_VOLUME, index, userdata);
+    reply->cb.success = done;
+    server->stats.volume_ops++;
+    server->stats.in_flight++;
+    if (server->stats.in_flight > server->stats.max_in_flight) {
+        server->stats.max_in_flight = server->stats.in_flight;
+    }
+    return reply;
+}
+
+static void
+mock_release(AudioBackend *backend, void *op) {
+    (void) backend;
+    free(op);
+}
+
+static void
+mock_cancel(AudioBackend *backend, void *op) {
+    MockServer *server = backend->userdata;
+    MockReply *reply = op;
+    if (reply->timer) {
+        server->api->time_free(reply->timer);
+        server->stats.in_flight--;
+    }
+    server->stats.cancelled_ops++;
+    free(reply);
+}
+
+static void
+mock_get_sink_input_info(AudioBackend *backend, uint32_t index,
+        pa_sink_input_info_cb_t cb, void *userdata)
+{
+    MockServer *server = backend->userdata;
+    schedule_reply(server, REPLY_SINK_INPUT, index, userdata)->cb.sink_input = cb;
+    server->stats.info_requests++;
+}
+
+static void
+mock_get_sink_input_info_list(AudioBackend *backend, pa_sink_input_info_cb_t cb, void *userdata) {
+    MockServer *server = backend->userdata;
+    schedule_reply(server, REPLY_SINK_INPUT_LIST, 0, userdata)->cb.sink_input = cb;
+    server->stats.info_requests++;
+}
+
+static void
+mock_get_client_info(AudioBackend *backend, uint32_t index, pa_client_info_cb_t cb, void *userdata) {
+    MockServer *server = backend->userdata;
+    schedule_reply(server, REPLY_CLIENT, index, userdata)->cb.client = cb;
+    server->stats.info_requests++;
+}
+
+static void
+mock_get_client_info_list(AudioBackend *backend, pa_client_info_cb_t cb, void *userdata) {
+    MockServer *server = backend->userdata;
+    schedule_reply(server, REPLY_CLIENT_LIST, 0, userdata)->cb.client = cb;
+    server->stats.info_requests++;
+}
+
+static void
+mock_subscribe(AudioBackend *backend, pa_subscription_mask_t mask,
+        pa_context_subscribe_cb_t cb, void *userdata)
+{
+    MockServer *server = backend->userdata;
+    server->mask = mask;
+    server->subscribe_cb = cb;
+    server->subscribe_userdata = userdata;
+}
+
+MockServer *
+mock_server_new(pa_mainloop_api *api, pa_usec_t latency) {
+    MockServer *server = calloc(1, sizeof(*server));
+    assert(server);
+    server->api = api;
+    server->latency = latency;
+    return server;
+}
+
+void
+mock_server_free(MockServer *server) {
+    // replies still scheduled go away with the main loop
+    for (uint32_t i = 0; i < server->num_sink_inputs; i++) {
+        if (server->sink_inputs[i].used) {
+            pa_proplist_free(server->sink_inputs[i].proplist);
+        }
+    }
+    for (uint32_t i = 0; i < server->num_clients; i++) {
+        if (server->clients[i].used) {
+            pa_proplist_free(server->clients[i].proplist);
+        }
+    }
+    free(server->sink_inputs);
+    free(server->clients);
+    free(server);
+}
+
+void
+mock_server_init_backend(MockServer *server, AudioBackend *backend) {
+    *backend = (AudioBackend) {
+        .userdata = server,
+        .set_sink_input_volume = mock_set_sink_input_volume,
+        .release = mock_release,
+        .cancel = mock_cancel,
+        .get_sink_input_info = mock_get_sink_input_info,
+        .get_sink_input_info_list = mock_get_sink_input_info_list,
+        .get_client_info = mock_get_client_info,
+        .get_client_info_list = mock_get_client_info_list,
+        .subscribe = mock_subscribe,
+    };
+}
+
+uint32_t
+mock_server_add_client(MockServer *server, pid_t pid) {
+    if (server->num_clients == server->client_capacity) {
+        server->client_capacity = server->client_capacity ? server->client_capacity * 2 : 64;
+        server->clients = realloc(server->clients, server->client_capacity * sizeof(*server->clients));
+        assert(server->clients);
+    }
+    uint32_t index = server->num_clients++;
+    MockClient *client = &server->clients[index];
+    client->used = true;
+    client->proplist = pa_proplist_new();
+    pa_proplist_setf(client->proplist, PA_PROP_APPLICATION_PROCESS_ID, "%d", (int) pid);
+
+    emit_event(server, PA_SUBSCRIPTION_EVENT_CLIENT | PA_SUBSCRIPTION_EVENT_NEW, index);
+    return index;
+}
+
+uint32_t
+mock_server_add_sink_input(MockServer *server, uint32_t client, uint8_t channels) {
+    assert(get_client(server, client));
+    if (server->num_sink_inputs == server->sink_input_capacity) {
+        server->sink_input_capacity = server->sink_input_capacity ? server->sink_input_capacity * 2 : 64;
+        server->sink_inputs = realloc(server->sink_inputs,
+                server->sink_input_capacity * sizeof(*server->sink_inputs));
+        assert(server->sink_inputs);
+    }
+    uint32_t index = server->num_sink_inputs++;
+    MockSinkInput *input = &server->sink_inputs[index];
+    input->used = true;
+    input->client = client;
+    pa_cvolume_set(&input->volume, channels, PA_VOLUME_NORM);
+    // like PulseAudio, streams inherit their client's properties
+    input->proplist = pa_proplist_copy(server->clients[client].proplist);
+
+    emit_event(server, PA_SUBSCRIPTION_EVENT_SINK_INPUT | PA_SUBSCRIPTION_EVENT_NEW, index);
+    return index;
+}
+
+void
+mock_server_remove_sink_input(MockServer *server, uint32_t index) {
+    MockSinkInput *input = get_sink_input(server, index);
+    if (!input) {
+        return;
+    }
+    pa_proplist_free(input->proplist);
+    input->used = false;
+    input->proplist = NULL;
+    emit_event(server, PA_SUBSCRIPTION_EVENT_SINK_INPUT | PA_SUBSCRIPTION_EVENT_REMOVE, index);
+}
+
+const MockStats *
+mock_server_stats(MockServer *server) {
+    return &server->stats;
+}
@@ -0,0 +1,51 @@
+#ifndef MOCK_H
+#define MOCK_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <pulse/pulseaudio.h>
+
+#include "backend.h"
+
+/**
+ * In-process stand-in for a sound server, for load testing the engine
+ * without touching a real one. Replies and subscription events are
+ * delivered from the main loop after a fixed latency, and volume changes
+ * are echoed as change events, like PulseAudio does.
+ */
+typedef struct MockServer MockServer;
+
+typedef struct {
+    int64_t volume_ops;
+    int64_t cancelled_ops;
+    int64_t info_requests;
+    int64_t events;
+    // volume operations sent but not replied to yet
+    int32_t in_flight;
+    int32_t max_in_flight;
+} MockStats;
+
+MockServer *mock_server_new(pa_mainloop_api *api, pa_usec_t latency);
+void mock_server_free(MockServer *server);
+
+/**
+ * Make `backend` send its requests to `server`.
+ */
+void mock_server_init_backend(MockServer *server, AudioBackend *backend);
+
+/**
+ * Add a client with `application.process.id` set to `pid`, returns its
+ * index.
+ */
+uint32_t mock_server_add_client(MockServer *server, pid_t pid);
+
+/**
+ * Add a sink input of `client` at full volume, returns its index.
+ */
+uint32_t mock_server_add_sink_input(MockServer *server, uint32_t client, uint8_t channels);
+void mock_server_remove_sink_input(MockServer *server, uint32_t index);
+
+const MockStats *mock_server_stats(MockServer *server);
+
+#endif /* MOCK_H */
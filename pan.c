@@ -0,0 +1,139 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "pan.h"
+
+/*
+ * Speakers are placed on a square around the listener, x from -1 (left) to
+ * 1 (right) and y from -1 (rear) to 1 (front). A window pans like a balance
+ * control: speakers on the side it is on stay at full volume, the others
+ * fade out the further it moves away, in proportion to how far off center
+ * they are. Vertically, windows at the top of the screen are in front of the
+ * listener and fade out the rear speakers; at the bottom, all are at full
+ * volume. Speakers without a direction, like the LFE, are never panned.
+ */
+typedef struct {
+    float x;
+    float y;
+} SpeakerPosition;
+
+static SpeakerPosition
+speaker_position(pa_channel_position_t position) {
+    switch (position) {
+        case PA_CHANNEL_POSITION_FRONT_LEFT:
+        case PA_CHANNEL_POSITION_TOP_FRONT_LEFT:
+            return (SpeakerPosition) { -1.0f, 1.0f };
+        case PA_CHANNEL_POSITION_FRONT_RIGHT:
+        case PA_CHANNEL_POSITION_TOP_FRONT_RIGHT:
+            return (SpeakerPosition) { 1.0f, 1.0f };
+        case PA_CHANNEL_POSITION_FRONT_CENTER:
+        case PA_CHANNEL_POSITION_TOP_FRONT_CENTER:
+            return (SpeakerPosition) { 0.0f, 1.0f };
+        case PA_CHANNEL_POSITION_FRONT_LEFT_OF_CENTER:
+            return (SpeakerPosition) { -0.5f, 1.0f };
+        case PA_CHANNEL_POSITION_FRONT_RIGHT_OF_CENTER:
+            return (SpeakerPosition) { 0.5f, 1.0f };
+        case PA_CHANNEL_POSITION_SIDE_LEFT:
+            return (SpeakerPosition) { -1.0f, 0.0f };
+        case PA_CHANNEL_POSITION_SIDE_RIGHT:
+            return (SpeakerPosition) { 1.0f, 0.0f };
+        case PA_CHANNEL_POSITION_REAR_LEFT:
+        case PA_CHANNEL_POSITION_TOP_REAR_LEFT:
+            return (SpeakerPosition) { -1.0f, -1.0f };
+        case PA_CHANNEL_POSITION_REAR_RIGHT:
+        case PA_CHANNEL_POSITION_TOP_REAR_RIGHT:
+            return (SpeakerPosition) { 1.0f, -1.0f };
+        case PA_CHANNEL_POSITION_REAR_CENTER:
+        case PA_CHANNEL_POSITION_TOP_REAR_CENTER:
+            return (SpeakerPosition) { 0.0f, -1.0f };
+        default:
+            // mono, LFE, top center and aux channels
+            return (SpeakerPosition) { 0.0f, 0.0f };
+    }
+}
+
+/**
+ * Gain of a speaker at `speaker` on one axis for a window at `window`, both
+ * in [-1, 1]: full volume unless the window is on the opposite side.
+ */
+static uint16_t
+axis_gain(float speaker, float window) {
+    float away = speaker < 0.0f ? window : -window;
+    float gain = away > 0.0f ? 1.0f - away * (speaker < 0.0f ? -speaker : speaker) : 1.0f;
+    return (uint16_t) (gain * PAN_ONE + 0.5f);
+}
+
+PanPosition
+pan_position(float balance, float front) {
+    PanPosition position = {
+        .x = (int32_t) (balance * PAN_STEPS + 0.5f),
+        .y = (int32_t) (front * PAN_STEPS + 0.5f),
+    };
+    position.x = position.x < 0 ? 0 : position.x > PAN_STEPS ? PAN_STEPS : position.x;
+    position.y = position.y < 0 ? 0 : position.y > PAN_STEPS ? PAN_STEPS : position.y;
+    return position;
+}
+
+static PanTable *
+pan_table_new(const pa_channel_map *map) {
+    size_t row = PAN_STEPS + 1;
+    PanTable *table = malloc(sizeof(*table) + 2 * map->channels * row * sizeof(uint16_t));
+    if (!table) {
+        return NULL;
+    }
+    table->next = NULL;
+    table->map = *map;
+
+    uint16_t *x_gains = table->gains;
+    uint16_t *y_gains = table->gains + map->channels * row;
+    for (unsigned channel = 0; channel < map->channels; channel++) {
+        SpeakerPosition speaker = speaker_position(map->map[channel]);
+        for (int32_t step = 0; step <= PAN_STEPS; step++) {
+            float x = 2.0f * step / PAN_STEPS - 1.0f;
+            // windows never go behind the listener, so y only covers [0, 1]
+            float y = (float) step / PAN_STEPS;
+            x_gains[channel * row + step] = axis_gain(speaker.x, x);
+            y_gains[channel * row + step] = axis_gain(speaker.y, y);
+        }
+    }
+    return table;
+}
+
+const PanTable *
+pan_table_get(PanTables *tables, const pa_channel_map *map) {
+    for (PanTable *table = tables->tables; table; table = table->next) {
+        if (pa_channel_map_equal(&table->map, map)) {
+            return table;
+        }
+    }
+    PanTable *table = pan_table_new(map);
+    if (table) {
+        table->next = tables->tables;
+        tables->tables = table;
+    }
+    return table;
+}
+
+void
+pan_tables_free(PanTables *tables) {
+    PanTable *table = tables->tables;
+    while (table) {
+        PanTable *next = table->next;
+        free(table);
+        table = next;
+    }
+    tables->tables = NULL;
+}
+
+void
+pan_apply(const PanTable *table, PanPosition position, const pa_cvolume *volume, pa_cvolume *result) {
+    *result = *volume;
+    unsigned channels = volume->channels < table->map.channels ? volume->channels : table->map.channels;
+    size_t row = PAN_STEPS + 1;
+    const uint16_t *x_gains = table->gains + position.x;
+    const uint16_t *y_gains = table->gains + table->map.channels * row + position.y;
+    for (unsigned channel = 0; channel < channels; channel++) {
+        uint32_t gain = ((uint32_t) x_gains[channel * row] * y_gains[channel * row]) >> 15;
+        result->values[channel] = (pa_volume_t) (((uint64_t) volume->values[channel] * gain) >> 15);
+    }
+}
@@ -0,0 +1,61 @@
+#ifndef PAN_H
+#define PAN_H
+
+#include <stdint.h>
+
+#include <pulse/pulseaudio.h>
+
+// positions per axis a window's center is quantized to
+#define PAN_STEPS 256
+// gain of 1.0 in the Q15 fixed point format of the tables
+#define PAN_ONE (1 << 15)
+
+/**
+ * Gains of all channels of one channel map, for each quantized horizontal
+ * and vertical window position, so that panning a stream costs two lookups
+ * and a multiplication per channel.
+ */
+typedef struct PanTable {
+    struct PanTable *next;
+    pa_channel_map map;
+    // `map.channels` rows of PAN_STEPS + 1 horizontal gains, followed by as
+    // many rows of vertical gains
+    uint16_t gains[];
+} PanTable;
+
+/**
+ * Cache of the tables of all channel maps seen so far; there are usually
+ * only a handful.
+ */
+typedef struct {
+    PanTable *tables;
+} PanTables;
+
+// quantized position of a window's center
+typedef struct {
+    // from 0 (left edge) to PAN_STEPS (right edge)
+    int32_t x;
+    // from 0 (bottom edge) to PAN_STEPS (top edge)
+    int32_t y;
+} PanPosition;
+
+/**
+ * Position with `balance` from 0.0f (only left) to 1.0f (only right) and
+ * `front` from 0.0f (bottom of the screen) to 1.0f (top of the screen).
+ */
+PanPosition pan_position(float balance, float front);
+
+/**
+ * Table of `map`, built on first use. Returns NULL if out of memory.
+ */
+const PanTable *pan_table_get(PanTables *tables, const pa_channel_map *map);
+
+void pan_tables_free(PanTables *tables);
+
+/**
+ * Scale each channel of `volume` by its gain at `position`, and write the
+ * result to `result`. Channels beyond those of the table keep their volume.
+ */
+void pan_apply(const PanTable *table, PanPosition position, const pa_cvolume *volume, pa_cvolume *result);
+
+#endif /* PAN_H */
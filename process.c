@@ -1,31 +1,23 @@
 #include <assert.h>
 #include <ctype.h>
+#include <errno.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 
 #include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/connector.h>
+#include <linux/cn_proc.h>
 
 #include "arena.h"
-
-typedef struct ProcessNode {
-    pid_t pid;
-    struct ProcessNode *next;
-    struct ProcessNode *children;
-} ProcessNode;
-
-#define EXP_MAX_PROCESSES 12
-#define NUM_MAX_PROCESSES (1 << EXP_MAX_PROCESSES)
-
-typedef struct {
-    ProcessNode *root;
-    int32_t count;
-
-    Arena *arena;
-
-    // MSI hashtable mapping PID -> ProcessNode*
-    ProcessNode *ht[NUM_MAX_PROCESSES];
-} ProcessTree;
+#include "hash.h"
+#include "process.h"
 
 bool
 is_numeric(const char *s) {
@@ -38,113 +30,775 @@ is_numeric(const char *s) {
     return true;
 }
 
+// initial sizes, both grow by doubling
+#define PROCESS_TREE_INITIAL_EXP 10
+#define PROCESS_TREE_INITIAL_NODES 256
+// exited nodes tolerated before compacting, on top of the number of alive ones
+#define PROCESS_TREE_MIN_COMPACT 4096
+
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
 static int32_t
-ht_lookup(uint64_t hash, int exp, int32_t index) {
-    uint32_t mask = ((uint32_t)1 << exp) - 1;
-    uint32_t step = (hash >> (64 - exp)) | 1;
-    return (index + step) & mask;
+process_tree_find(ProcessTree *tree, pid_t pid) {
+    // the table is at most half full, so probing always hits an empty slot
+    uint64_t hash = hash_u64((uint32_t) pid);
+    for (int32_t index = (int32_t) hash;;) {
+        index = ht_lookup(hash, tree->exp, index);
+        int32_t slot = tree->ht[index];
+        if (!slot) {
+            return PROCESS_NONE;
+        }
+        else if (tree->nodes[slot - 1].pid == pid) {
+            return slot - 1;
+        }
+    }
 }
 
-static ProcessNode *
+/**
+ * Double the hashtable and reinsert all nodes. The old table stays behind in
+ * the arena until the next rescan.
+ */
+static void
+process_tree_grow_table(ProcessTree *tree) {
+    int exp = tree->exp + 1;
+    int32_t *ht = ARENA_ALLOC_ARRAY(tree->arena, int32_t, (int32_t) 1 << exp);
+    for (int32_t i = 0; i < tree->num_nodes; i++) {
+        uint64_t hash = hash_u64((uint32_t) tree->nodes[i].pid);
+        int32_t index = (int32_t) hash;
+        do {
+            index = ht_lookup(hash, exp, index);
+        } while (ht[index]);
+        ht[index] = i + 1;
+    }
+    tree->ht = ht;
+    tree->exp = exp;
+}
+
+static void
+process_tree_grow_nodes(ProcessTree *tree) {
+    int32_t capacity = tree->node_capacity * 2;
+    ProcessNode *nodes = ARENA_ALLOC_ARRAY_EX(tree->arena, ProcessNode, capacity, ARENA_NOZERO);
+    memcpy(nodes, tree->nodes, tree->num_nodes * sizeof(*nodes));
+    tree->nodes = nodes;
+    tree->node_capacity = capacity;
+}
+
+/**
+ * Find or create the node of `pid`, returns its index. Creating nodes may
+ * move the node array, so pointers into it must not be held across calls.
+ */
+static int32_t
 process_tree_get(ProcessTree *tree, pid_t pid) {
-    // hash(pid) = pid
-    for (int32_t index = pid, count = 0; count < NUM_MAX_PROCESSES; count++) {
-        index = ht_lookup((uint64_t) pid, EXP_MAX_PROCESSES, index);
-        if (!tree->ht[index]) {
-            // empty slot found, create new node and return
-            ProcessNode *node = ARENA_ALLOC1(tree->arena, ProcessNode);
-            assert(node);
-            node->pid = pid;
-            tree->ht[index] = node;
-            return node;
-        }
-        else if (tree->ht[index]->pid == pid) {
-            // found
-            return tree->ht[index];
+    int32_t found = process_tree_find(tree, pid);
+    if (found != PROCESS_NONE) {
+        ProcessNode *node = &tree->nodes[found];
+        if (!node->alive) {
+            // PID got reused
+            node->alive = true;
+            tree->count++;
         }
+        return found;
     }
-    assert(0 && "map full");
+
+    if (tree->num_nodes == tree->node_capacity) {
+        process_tree_grow_nodes(tree);
+    }
+    if ((tree->num_nodes + 1) * 2 > (1 << tree->exp)) {
+        process_tree_grow_table(tree);
+    }
+
+    int32_t node_index = tree->num_nodes++;
+    tree->nodes[node_index] = (ProcessNode) {
+        .pid = pid,
+        .alive = true,
+        .parent = PROCESS_NONE,
+        .next = PROCESS_NONE,
+        .prev = PROCESS_NONE,
+        .children = PROCESS_NONE,
+    };
+    tree->count++;
+
+    uint64_t hash = hash_u64((uint32_t) pid);
+    int32_t index = (int32_t) hash;
+    do {
+        index = ht_lookup(hash, tree->exp, index);
+    } while (tree->ht[index]);
+    tree->ht[index] = node_index + 1;
+    return node_index;
+}
+
+static void
+unlink_child(ProcessTree *tree, int32_t index) {
+    ProcessNode *node = &tree->nodes[index];
+    if (node->parent == PROCESS_NONE) {
+        return;
+    }
+    if (node->prev != PROCESS_NONE) {
+        tree->nodes[node->prev].next = node->next;
+    } else {
+        tree->nodes[node->parent].children = node->next;
+    }
+    if (node->next != PROCESS_NONE) {
+        tree->nodes[node->next].prev = node->prev;
+    }
+    node->parent = PROCESS_NONE;
+    node->next = PROCESS_NONE;
+    node->prev = PROCESS_NONE;
 }
 
 static void
 process_tree_insert(ProcessTree *tree, pid_t pid, pid_t parent_pid) {
-    tree->count++;
-    ProcessNode *node = process_tree_get(tree, pid);
-    ProcessNode *parent = process_tree_get(tree, parent_pid);
+    if (pid == parent_pid) {
+        return;
+    }
+
+    int32_t index = process_tree_get(tree, pid);
+    int32_t parent = process_tree_get(tree, parent_pid);
+
+    unlink_child(tree, index);
+    ProcessNode *node = &tree->nodes[index];
+    node->parent = parent;
+    node->next = tree->nodes[parent].children;
+    if (node->next != PROCESS_NONE) {
+        tree->nodes[node->next].prev = index;
+    }
+    tree->nodes[parent].children = index;
+}
+
+typedef struct {
+    pid_t *pids;
+    int32_t count;
+    int32_t capacity;
+} PidList;
+
+static void
+pid_list_push(Arena *arena, PidList *list, pid_t pid) {
+    if (list->count == list->capacity) {
+        // the old array stays behind in the arena
+        int32_t capacity = list->capacity ? list->capacity * 2 : 64;
+        pid_t *pids = ARENA_ALLOC_ARRAY_EX(arena, pid_t, capacity, ARENA_NOZERO);
+        if (list->count) {
+            memcpy(pids, list->pids, list->count * sizeof(*pids));
+        }
+        list->pids = pids;
+        list->capacity = capacity;
+    }
+    list->pids[list->count++] = pid;
+}
+
+// layout of the records returned by getdents64
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+// size of the buffer for directory entries, allocated from the arena
+#define DIRENT_BUFFER_SIZE (64 * 1024)
+
+// File descriptor of /proc, or of the root set with `process_set_root`,
+// opened once and kept, so that stat files can be opened relative to it.
+// Shared by all threads, so it is only used with openat; directory listings
+// go through descriptors of their own, see `load_process_tree`.
+static int proc_fd = -1;
+static pthread_once_t proc_fd_once = PTHREAD_ONCE_INIT;
+
+static void
+open_proc_fd(void) {
+    if (proc_fd < 0) {
+        proc_fd = open("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        assert(proc_fd >= 0);
+    }
+}
 
-    node->next = parent->children;
-    parent->children = node;
+static int
+get_proc_fd(void) {
+    pthread_once(&proc_fd_once, open_proc_fd);
+    return proc_fd;
+}
+
+bool
+process_set_root(const char *path) {
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    if (proc_fd >= 0) {
+        close(proc_fd);
+    }
+    proc_fd = fd;
+    return true;
+}
+
+/**
+ * Parse the parent PID from the contents of /proc/<pid>/stat. The command
+ * name in the second field may contain spaces and parentheses, so the
+ * fields are located relative to the last ')'.
+ */
+static bool
+parse_stat_parent_pid(const char *buffer, ssize_t len, pid_t *parent_pid) {
+    const char *end = buffer + len;
+    const char *it = end;
+    while (it > buffer && it[-1] != ')') {
+        it--;
+    }
+    if (it == buffer) {
+        return false;
+    }
+
+    // ") S 1234 ..."
+    if (end - it < 4 || it[0] != ' ' || it[2] != ' ') {
+        return false;
+    }
+    it += 3;
+
+    pid_t result = 0;
+    bool any = false;
+    for (; it < end && *it >= '0' && *it <= '9'; it++) {
+        result = result * 10 + (*it - '0');
+        any = true;
+    }
+    if (!any) {
+        return false;
+    }
+    *parent_pid = result;
+    return true;
+}
+
+/**
+ * Format `pid` in decimal into `buffer` without stdio; returns the start of
+ * the string, which is somewhere inside `buffer`.
+ */
+static const char *
+format_pid(char buffer[static 16], pid_t pid) {
+    char *it = buffer + 16;
+    *--it = '\0';
+    do {
+        *--it = '0' + (pid % 10);
+        pid /= 10;
+    } while (pid > 0);
+    return it;
+}
+
+/**
+ * `path = name + suffix`, returns false if it doesn't fit.
+ */
+static bool
+join_path(char *path, size_t size, const char *name, const char *suffix) {
+    size_t name_len = strlen(name);
+    size_t suffix_len = strlen(suffix);
+    if (name_len + suffix_len + 1 > size) {
+        return false;
+    }
+    memcpy(path, name, name_len);
+    memcpy(path + name_len, suffix, suffix_len + 1);
+    return true;
+}
+
+/**
+ * Read the parent PID of the process named `name` (its decimal PID) relative
+ * to `proc_fd`, without going through stdio.
+ */
+static bool
+read_parent_pid_at(int proc_fd, const char *name, pid_t *parent_pid) {
+    char path[32];
+    if (!join_path(path, sizeof(path), name, "/stat")) {
+        return false;
+    }
+
+    int fd = openat(proc_fd, path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        // probably a short-lived process which was still alive during
+        // getdents64() but isn't anymore
+        return false;
+    }
+    char buffer[512];
+    ssize_t len = read(fd, buffer, sizeof(buffer));
+    close(fd);
+    return len > 0 && parse_stat_parent_pid(buffer, len, parent_pid);
+}
+
+static bool
+read_parent_pid(pid_t pid, pid_t *parent_pid) {
+    char name[16];
+    return read_parent_pid_at(get_proc_fd(), format_pid(name, pid), parent_pid);
+}
+
+// below this many processes a parallel scan isn't worth the thread startup
+#define PARALLEL_SCAN_MIN_PROCESSES 2048
+// PIDs per worker at least, and the maximum number of workers
+#define PARALLEL_SCAN_MIN_SLICE 512
+#define PARALLEL_SCAN_MAX_WORKERS 16
+
+typedef struct {
+    int proc_fd;
+    const pid_t *pids;
+    // parent PID for each of `pids`, -1 if it couldn't be read
+    pid_t *parents;
+    int32_t count;
+} ScanSlice;
+
+static void *
+scan_slice(void *userdata) {
+    ScanSlice *slice = userdata;
+    for (int32_t i = 0; i < slice->count; i++) {
+        char name[16];
+        pid_t parent_pid;
+        if (!read_parent_pid_at(slice->proc_fd, format_pid(name, slice->pids[i]), &parent_pid)) {
+            parent_pid = -1;
+        }
+        slice->parents[i] = parent_pid;
+    }
+    return NULL;
+}
+
+static int32_t
+scan_worker_count(int32_t num_pids) {
+    if (num_pids < PARALLEL_SCAN_MIN_PROCESSES) {
+        return 1;
+    }
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int32_t workers = num_pids / PARALLEL_SCAN_MIN_SLICE;
+    if (cpus > 0 && workers > cpus) {
+        workers = cpus;
+    }
+    if (workers > PARALLEL_SCAN_MAX_WORKERS) {
+        workers = PARALLEL_SCAN_MAX_WORKERS;
+    }
+    return workers > 1 ? workers : 1;
+}
+
+/**
+ * Read the parent PIDs of `pids` into `parents`. Each worker takes a
+ * contiguous slice of its own, so no locking is needed; the calling thread
+ * takes the first one.
+ */
+static void
+scan_parents(int proc_fd, const pid_t *pids, pid_t *parents, int32_t count) {
+    int32_t workers = scan_worker_count(count);
+    ScanSlice slices[PARALLEL_SCAN_MAX_WORKERS];
+    pthread_t threads[PARALLEL_SCAN_MAX_WORKERS];
+    bool started[PARALLEL_SCAN_MAX_WORKERS] = {0};
+
+    int32_t per_worker = (count + workers - 1) / workers;
+    for (int32_t i = 0; i < workers; i++) {
+        int32_t begin = MIN(i * per_worker, count);
+        int32_t end = MIN(begin + per_worker, count);
+        slices[i] = (ScanSlice) {
+            .proc_fd = proc_fd,
+            .pids = pids + begin,
+            .parents = parents + begin,
+            .count = end - begin,
+        };
+        if (i > 0) {
+            started[i] = pthread_create(&threads[i], NULL, scan_slice, &slices[i]) == 0;
+        }
+    }
+
+    scan_slice(&slices[0]);
+    for (int32_t i = 1; i < workers; i++) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+        } else {
+            // couldn't start the thread, do its share here
+            scan_slice(&slices[i]);
+        }
+    }
 }
 
 static void
 load_process_tree(ProcessTree *tree, Arena *arena) {
-    DIR *dir = opendir("/proc");
-    assert(dir);
+    int proc_fd = get_proc_fd();
+    // Scans may run on several threads at once, e.g. the resolver's and the
+    // initial one, and a directory's read position is shared by everyone
+    // using the same descriptor, so list it through a fresh one.
+    int dir_fd = openat(proc_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    assert(dir_fd >= 0);
 
     tree->arena = arena;
     tree->count = 0;
 
-    struct dirent *entry;
-    while ((entry = readdir(dir))) {
-        if ((entry->d_type == DT_DIR)
-                && (strcmp(entry->d_name, ".") != 0)
-                && (strcmp(entry->d_name, "..") != 0)
-                && is_numeric(entry->d_name))
-        {
-            pid_t pid = atoi(entry->d_name);
-            char stat_file_path[PATH_MAX];
-            snprintf(stat_file_path, sizeof(stat_file_path),
-                    "/proc/%d/stat", pid);
-            FILE *f = fopen(stat_file_path, "rb");
-            if (f) {
-                pid_t parent_pid;
-                int matched = fscanf(f, "%*s %*s %*s %d", &parent_pid);
-                fclose(f);
-                if (matched) {
-                    process_tree_insert(tree, pid, parent_pid);
-                }
-            } else {
-                // couldn't open process file, probably short-lived process
-                // which was still alive during readdir() but isn't anymore
+    // list all processes first, so reading their stat files can be split up
+    PidList pids = {0};
+    char *buffer = ARENA_ALLOC_ARRAY_EX(arena, char, DIRENT_BUFFER_SIZE, ARENA_NOZERO);
+    for (;;) {
+        long len = syscall(SYS_getdents64, dir_fd, buffer, DIRENT_BUFFER_SIZE);
+        if (len <= 0) {
+            break;
+        }
+
+        for (long offset = 0; offset < len;) {
+            struct linux_dirent64 *entry = (struct linux_dirent64 *) (buffer + offset);
+            offset += entry->d_reclen;
+
+            // only the numeric directories are processes
+            const char *name = entry->d_name;
+            if (entry->d_type != DT_DIR || name[0] < '0' || name[0] > '9' || !is_numeric(name)) {
+                continue;
             }
+            pid_list_push(arena, &pids, atoi(name));
         }
     }
+    close(dir_fd);
 
-    closedir(dir);
+    pid_t *parents = ARENA_ALLOC_ARRAY_EX(arena, pid_t, MAX(pids.count, 1), ARENA_NOZERO);
+    scan_parents(proc_fd, pids.pids, parents, pids.count);
+
+    // the tree itself is only touched from this thread
+    for (int32_t i = 0; i < pids.count; i++) {
+        if (parents[i] >= 0) {
+            process_tree_insert(tree, pids.pids[i], parents[i]);
+        }
+    }
 }
 
 void
-debug_dump_process_node(ProcessNode *node, int depth) {
-    if (!node) {
-        return;
+process_tree_init(ProcessTree *tree, Arena *arena) {
+    memset(tree, 0, sizeof(*tree));
+    tree->arena = arena;
+    tree->exp = PROCESS_TREE_INITIAL_EXP;
+    tree->ht = ARENA_ALLOC_ARRAY(arena, int32_t, (int32_t) 1 << tree->exp);
+    tree->node_capacity = PROCESS_TREE_INITIAL_NODES;
+    tree->nodes = ARENA_ALLOC_ARRAY_EX(arena, ProcessNode, tree->node_capacity, ARENA_NOZERO);
+}
+
+/**
+ * Throw away all nodes and pending deltas, keeping the hooks.
+ */
+static void
+process_tree_reset(ProcessTree *tree) {
+    ProcessTree old = *tree;
+    arena_clear(old.arena);
+    process_tree_init(tree, old.arena);
+    tree->on_change = old.on_change;
+    tree->on_parent = old.on_parent;
+    tree->on_resync = old.on_resync;
+    tree->userdata = old.userdata;
+    tree->deltas = old.deltas;
+    tree->delta_capacity = old.delta_capacity;
+}
+
+void
+process_tree_rescan(ProcessTree *tree) {
+    process_tree_reset(tree);
+    load_process_tree(tree, tree->arena);
+
+    if (tree->on_change) {
+        tree->on_change(tree->userdata, -1);
     }
+}
 
-    for (int i = 0; i < depth; i++) printf("  ");
+static bool process_tree_unlink_exited(ProcessTree *tree, pid_t pid, bool notify);
 
-    printf("Process(%d)\n", node->pid);
-    for (ProcessNode *child = node->children; child; child = child->next) {
-        debug_dump_process_node(child, depth + 1);
+/**
+ * Apply the first `num_deltas` logged forks and exits again, on top of a
+ * freshly loaded snapshot. Forks already in the snapshot just get relinked
+ * to the same parent, and exits of processes it doesn't have are ignored.
+ * Forks of processes which exited again are skipped, rather than leaving
+ * behind the exited nodes the resync may have been meant to compact away.
+ */
+static void
+process_tree_apply_deltas(ProcessTree *tree, int32_t num_deltas) {
+    HashMap last_exits;
+    hash_map_init(&last_exits, PROCESS_TREE_INITIAL_EXP);
+    for (int32_t i = 0; i < num_deltas; i++) {
+        if (tree->deltas[i].parent_pid < 0) {
+            hash_map_put(&last_exits, (uint32_t) tree->deltas[i].pid, &tree->deltas[i]);
+        }
+    }
+    for (int32_t i = 0; i < num_deltas; i++) {
+        ProcessDelta *delta = &tree->deltas[i];
+        if (delta->parent_pid >= 0) {
+            ProcessDelta *exit = hash_map_get(&last_exits, (uint32_t) delta->pid);
+            if (!exit || exit < delta) {
+                process_tree_insert(tree, delta->pid, delta->parent_pid);
+            }
+        } else {
+            process_tree_unlink_exited(tree, delta->pid, false);
+        }
     }
+    free(last_exits.slots);
+}
+
+void
+process_tree_load(ProcessTree *tree, const pid_t *pids, const pid_t *parents, int32_t count) {
+    int32_t num_deltas = tree->num_deltas;
+    process_tree_reset(tree);
+    for (int32_t i = 0; i < count; i++) {
+        process_tree_insert(tree, pids[i], parents[i]);
+    }
+    if (num_deltas > 0) {
+        process_tree_apply_deltas(tree, num_deltas);
+    }
+
+    if (tree->on_change) {
+        tree->on_change(tree->userdata, -1);
+    }
+}
+
+/**
+ * Rebuild the tree from /proc, on another thread if the owner provides one.
+ * Returns true if it was rescanned right away.
+ */
+static bool
+process_tree_resync(ProcessTree *tree) {
+    if (!tree->on_resync) {
+        process_tree_rescan(tree);
+        return true;
+    }
+    if (!tree->resync_pending) {
+        tree->resync_pending = true;
+        tree->on_resync(tree->userdata);
+    }
+    return false;
 }
 
 static void
-collect_children(ProcessNode *node, pid_t *children, int32_t capacity, int32_t *count) {
-    assert((*count) < capacity);
-    children[(*count)++] = node->pid;
+process_tree_log_delta(ProcessTree *tree, pid_t pid, pid_t parent_pid) {
+    if (!tree->resync_pending) {
+        return;
+    }
+    if (tree->num_deltas == tree->delta_capacity) {
+        int32_t capacity = tree->delta_capacity ? tree->delta_capacity * 2 : 256;
+        ProcessDelta *deltas = realloc(tree->deltas, capacity * sizeof(*deltas));
+        assert(deltas);
+        tree->deltas = deltas;
+        tree->delta_capacity = capacity;
+    }
+    tree->deltas[tree->num_deltas++] = (ProcessDelta) { pid, parent_pid };
+}
 
-    for (ProcessNode *child = node->children; child; child = child->next) {
-        collect_children(child, children, capacity, count);
+void
+process_tree_add(ProcessTree *tree, pid_t pid, pid_t parent_pid) {
+    if (tree->num_nodes - tree->count > MAX(tree->count, PROCESS_TREE_MIN_COMPACT)) {
+        // Exited processes keep their slots, so once they outnumber the
+        // living ones compact the table by rebuilding it. The new process is
+        // already visible in /proc at this point.
+        if (process_tree_resync(tree)) {
+            return;
+        }
+    }
+    process_tree_log_delta(tree, pid, parent_pid);
+    process_tree_insert(tree, pid, parent_pid);
+    if (tree->on_parent) {
+        tree->on_parent(tree->userdata, pid, parent_pid);
+    }
+}
+
+/**
+ * Mark `pid` as exited and move its children to their new parents, telling
+ * `on_parent` about them if `notify`. Returns false if it wasn't alive.
+ */
+static bool
+process_tree_unlink_exited(ProcessTree *tree, pid_t pid, bool notify) {
+    int32_t index = process_tree_find(tree, pid);
+    if (index == PROCESS_NONE || !tree->nodes[index].alive) {
+        return false;
+    }
+
+    tree->nodes[index].alive = false;
+    tree->count--;
+    unlink_child(tree, index);
+
+    // Orphans get reparented by the kernel, to init or to the closest
+    // subreaper, so ask /proc where they ended up.
+    int32_t child;
+    while ((child = tree->nodes[index].children) != PROCESS_NONE) {
+        unlink_child(tree, child);
+        pid_t child_pid = tree->nodes[child].pid;
+
+        pid_t parent_pid;
+        if (!read_parent_pid(child_pid, &parent_pid) || parent_pid == pid) {
+            parent_pid = 1;
+        }
+        process_tree_insert(tree, child_pid, parent_pid);
+        if (notify && tree->on_parent) {
+            tree->on_parent(tree->userdata, child_pid, parent_pid);
+        }
+    }
+    return true;
+}
+
+void
+process_tree_remove(ProcessTree *tree, pid_t pid) {
+    process_tree_log_delta(tree, pid, -1);
+    if (process_tree_unlink_exited(tree, pid, true) && tree->on_change) {
+        tree->on_change(tree->userdata, pid);
+    }
+}
+
+int32_t
+process_tree_get_ancestors(ProcessTree *tree, pid_t pid, pid_t *ancestors, int32_t capacity) {
+    int32_t count = 0;
+    while (pid > 0 && count < capacity) {
+        ancestors[count++] = pid;
+
+        pid_t parent_pid;
+        int32_t index = process_tree_find(tree, pid);
+        if (index != PROCESS_NONE && tree->nodes[index].alive) {
+            int32_t parent = tree->nodes[index].parent;
+            parent_pid = parent != PROCESS_NONE ? tree->nodes[parent].pid : 0;
+        } else if (!read_parent_pid(pid, &parent_pid)) {
+            break;
+        }
+        pid = parent_pid;
+    }
+    return count;
+}
+
+void
+debug_dump_process_node(ProcessTree *tree, int32_t index, int depth) {
+    if (index == PROCESS_NONE) {
+        return;
+    }
+
+    for (int i = 0; i < depth; i++) printf("  ");
+
+    printf("Process(%d)\n", tree->nodes[index].pid);
+    for (int32_t child = tree->nodes[index].children; child != PROCESS_NONE; child = tree->nodes[child].next) {
+        debug_dump_process_node(tree, child, depth + 1);
     }
 }
 
 int32_t
-get_children_recursive(Arena *arena, pid_t parent, pid_t **children) {
-    ProcessTree tree = {0};
-    load_process_tree(&tree, arena);
-    ProcessNode *node = process_tree_get(&tree, parent);
-    *children = ARENA_ALLOC_ARRAY(arena, pid_t, tree.count);
-    int32_t child_count = 0;
-    collect_children(node, *children, tree.count, &child_count);
-    return child_count;
+process_tree_get_descendants(ProcessTree *tree, Arena *arena, pid_t parent, pid_t **children) {
+    int32_t index = process_tree_find(tree, parent);
+    if (index == PROCESS_NONE || !tree->nodes[index].alive) {
+        *children = NULL;
+        return 0;
+    }
+
+    // Breadth-first over node indices, so deep chains don't recurse. The
+    // queue holds indices and is turned into PIDs in place afterwards.
+    int32_t *queue = ARENA_ALLOC_ARRAY_EX(arena, int32_t, tree->num_nodes, ARENA_NOZERO);
+    int32_t count = 0;
+    queue[count++] = index;
+    for (int32_t i = 0; i < count; i++) {
+        for (int32_t child = tree->nodes[queue[i]].children;
+                child != PROCESS_NONE && count < tree->num_nodes;
+                child = tree->nodes[child].next)
+        {
+            queue[count++] = child;
+        }
+    }
+
+    static_assert(sizeof(pid_t) == sizeof(int32_t), "PIDs are stored in place of indices");
+    pid_t *pids = (pid_t *) queue;
+    for (int32_t i = 0; i < count; i++) {
+        pids[i] = tree->nodes[queue[i]].pid;
+    }
+    *children = pids;
+    return count;
+}
+
+int
+process_events_open(void) {
+    int fd = socket(PF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_CONNECTOR);
+    if (fd < 0) {
+        return -1;
+    }
+
+    // a larger buffer makes losing events during fork bombs less likely
+    int rcvbuf = 1024 * 1024;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+    struct sockaddr_nl addr = {
+        .nl_family = AF_NETLINK,
+        .nl_groups = CN_IDX_PROC,
+        // let the kernel pick the port ID: getpid() is taken if any other
+        // netlink socket of this process claimed it first
+        .nl_pid = 0,
+    };
+    socklen_t addr_len = sizeof(addr);
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0
+            || getsockname(fd, (struct sockaddr *) &addr, &addr_len) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    struct __attribute__((aligned(NLMSG_ALIGNTO))) {
+        struct nlmsghdr header;
+        struct __attribute__((packed)) {
+            struct cn_msg message;
+            enum proc_cn_mcast_op op;
+        };
+    } request = {0};
+    request.header.nlmsg_len = sizeof(request);
+    request.header.nlmsg_pid = addr.nl_pid;
+    request.header.nlmsg_type = NLMSG_DONE;
+    request.message.id.idx = CN_IDX_PROC;
+    request.message.id.val = CN_VAL_PROC;
+    request.message.len = sizeof(enum proc_cn_mcast_op);
+    request.op = PROC_CN_MCAST_LISTEN;
+
+    if (send(fd, &request, sizeof(request), 0) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+bool
+process_events_dispatch(ProcessTree *tree, int fd) {
+    char buffer[8192] __attribute__((aligned(NLMSG_ALIGNTO)));
+
+    for (;;) {
+        ssize_t len = recv(fd, buffer, sizeof(buffer), 0);
+        if (len < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return true;
+            } else if (errno == EINTR) {
+                continue;
+            } else if (errno == ENOBUFS) {
+                // the kernel dropped events, we're out of sync
+                process_tree_resync(tree);
+                continue;
+            } else {
+                return false;
+            }
+        }
+
+        for (struct nlmsghdr *header = (struct nlmsghdr *) buffer;
+                NLMSG_OK(header, (size_t) len);
+                header = NLMSG_NEXT(header, len))
+        {
+            if (header->nlmsg_type == NLMSG_NOOP || header->nlmsg_type == NLMSG_ERROR) {
+                continue;
+            }
+
+            struct cn_msg *message = NLMSG_DATA(header);
+            if (message->id.idx != CN_IDX_PROC || message->id.val != CN_VAL_PROC) {
+                continue;
+            }
+
+            struct proc_event *event = (struct proc_event *) message->data;
+            switch (event->what) {
+                case PROC_EVENT_NONE:
+                    // acknowledgement of our subscription request
+                    if (event->event_data.ack.err != 0) {
+                        return false;
+                    }
+                    break;
+                case PROC_EVENT_FORK:
+                    // ignore new threads
+                    if (event->event_data.fork.child_pid == event->event_data.fork.child_tgid) {
+                        process_tree_add(tree,
+                                event->event_data.fork.child_tgid,
+                                event->event_data.fork.parent_tgid);
+                    }
+                    break;
+                case PROC_EVENT_EXIT:
+                    if (event->event_data.exit.process_pid == event->event_data.exit.process_tgid) {
+                        process_tree_remove(tree, event->event_data.exit.process_tgid);
+                    }
+                    break;
+                default:
+                    break;
+            }
+        }
+    }
 }
 
@@ -0,0 +1,133 @@
+#ifndef PROCESS_H
+#define PROCESS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "arena.h"
+
+// index of no node, e.g. the parent of a root
+#define PROCESS_NONE (-1)
+
+typedef struct {
+    pid_t pid;
+    // false for processes which exited; their hashtable slot is kept so the
+    // node can be revived if the PID gets reused
+    bool alive;
+    // indices into `ProcessTree.nodes`, or PROCESS_NONE
+    int32_t parent;
+    int32_t next;
+    int32_t prev;
+    int32_t children;
+} ProcessNode;
+
+// fork (parent_pid >= 0) or exit (parent_pid == -1) applied while a
+// resync is pending
+typedef struct {
+    pid_t pid;
+    pid_t parent_pid;
+} ProcessDelta;
+
+typedef struct {
+    // contiguous node array, grown from the arena as needed
+    ProcessNode *nodes;
+    // number of used nodes, including exited and implicit parent ones
+    int32_t num_nodes;
+    int32_t node_capacity;
+    // number of alive nodes
+    int32_t count;
+
+    // MSI hashtable mapping PID -> node index + 1, 0 for empty slots
+    int32_t *ht;
+    int exp;
+
+    Arena *arena;
+
+    // Called after a process exited and its children were reparented, and
+    // with pid == -1 after a full rescan, i.e. whenever ancestries change.
+    void (*on_change)(void *userdata, pid_t pid);
+    // Called whenever a process gets a new parent other than by a rescan:
+    // after it forked, and for each orphan of an exited process before
+    // `on_change`, e.g. to record the tree's changes.
+    void (*on_parent)(void *userdata, pid_t pid, pid_t parent_pid);
+    // If set, called instead of rescanning inline when the tree needs a full
+    // rescan, i.e. to compact it or after the proc connector dropped events,
+    // so that the owner can scan on another thread and pass the result to
+    // `process_tree_load`. Called once until then.
+    void (*on_resync)(void *userdata);
+    void *userdata;
+
+    // forks and exits since `on_resync` was called, applied again on top of
+    // the snapshot which answers it, as they may have happened after it was
+    // taken
+    bool resync_pending;
+    ProcessDelta *deltas;
+    int32_t num_deltas;
+    int32_t delta_capacity;
+} ProcessTree;
+
+/**
+ * Read processes from `path` instead of /proc from now on, e.g. from a
+ * fixture built by `proc_fixture_build`. Returns false if it can't be
+ * opened, in which case the previous root stays in use.
+ */
+bool process_set_root(const char *path);
+
+/**
+ * Initialize a long-lived `tree` whose nodes live in `arena`, which is owned
+ * by the tree and cleared on every rescan. The node array and hashtable start
+ * small and grow with the number of processes.
+ */
+void process_tree_init(ProcessTree *tree, Arena *arena);
+
+/**
+ * Throw away all nodes and rebuild the tree from a full scan of /proc.
+ */
+void process_tree_rescan(ProcessTree *tree);
+
+/**
+ * Throw away all nodes and rebuild the tree from `count` pairs of PIDs and
+ * their parents, e.g. from a recorded snapshot or one taken on another
+ * thread, followed by the forks and exits applied since a resync was
+ * requested.
+ */
+void process_tree_load(ProcessTree *tree, const pid_t *pids, const pid_t *parents, int32_t count);
+
+/**
+ * Write all alive processes and their parents (0 for roots) to arrays
+ * allocated from `arena`. Returns their number.
+ */
+int32_t process_tree_snapshot(ProcessTree *tree, Arena *arena, pid_t **pids, pid_t **parents);
+
+void process_tree_add(ProcessTree *tree, pid_t pid, pid_t parent_pid);
+void process_tree_remove(ProcessTree *tree, pid_t pid);
+
+/**
+ * Collect `parent` and all of its descendants into an array allocated from
+ * `arena`. Returns the number of PIDs, or 0 if `parent` is not in the tree.
+ */
+int32_t process_tree_get_descendants(ProcessTree *tree, Arena *arena, pid_t parent, pid_t **children);
+
+/**
+ * Write `pid` followed by its ancestors, parent first, to `ancestors`.
+ * Processes not (yet) in the tree are looked up in /proc. Returns the
+ * number of PIDs written.
+ */
+int32_t process_tree_get_ancestors(ProcessTree *tree, pid_t pid, pid_t *ancestors, int32_t capacity);
+
+/**
+ * Subscribe to fork/exit notifications from the kernel proc connector.
+ * Returns a non-blocking socket, or -1 if the connector is unavailable.
+ */
+int process_events_open(void);
+
+/**
+ * Apply all pending proc connector notifications on `fd` to `tree`.
+ * Returns false if the connector turned out to be unusable (e.g. missing
+ * privileges), in which case the caller should close `fd` and fall back to
+ * periodic rescans.
+ */
+bool process_events_dispatch(ProcessTree *tree, int fd);
+
+#endif /* PROCESS_H */
@@ -0,0 +1,74 @@
+#define _XOPEN_SOURCE 700
+
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "procfixture.h"
+
+static int32_t
+fixture_parent(FixtureShape shape, int32_t pid) {
+    if (pid == 1) {
+        return 0;
+    }
+    switch (shape) {
+        case FIXTURE_CHAIN:
+            return pid - 1;
+        case FIXTURE_FAN:
+            return 1;
+        case FIXTURE_TREE:
+        default: {
+            // fixed seed per PID, so fixtures are reproducible
+            uint64_t x = (uint64_t) pid * 0x9e3779b97f4a7c15;
+            x ^= x >> 31;
+            return 1 + (int32_t) (x % (uint64_t) (pid - 1));
+        }
+    }
+}
+
+static bool
+write_file(const char *path, const char *data, size_t len) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = write(fd, data, len) == (ssize_t) len;
+    close(fd);
+    return ok;
+}
+
+bool
+proc_fixture_build(const char *root, FixtureShape shape, int32_t count) {
+    bool ok = true;
+    char path[4096];
+    for (int32_t pid = 1; ok && pid <= count; pid++) {
+        snprintf(path, sizeof(path), "%s/%d", root, pid);
+        ok = mkdir(path, 0755) == 0;
+
+        char stat[256];
+        int len = snprintf(stat, sizeof(stat),
+                "%d (fixture %d) S %d %d %d 0 -1 4194560 0 0 0 0 0 0 0 0 20 0 1 0 0 0 0\n",
+                pid, pid, fixture_parent(shape, pid), pid, pid);
+        snprintf(path, sizeof(path), "%s/%d/stat", root, pid);
+        ok = ok && write_file(path, stat, len);
+    }
+    return ok;
+}
+
+static int
+remove_entry(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    (void) st;
+    (void) type;
+    (void) ftw;
+    remove(path);
+    return 0;
+}
+
+void
+proc_fixture_remove(const char *root) {
+    nftw(root, remove_entry, 64, FTW_DEPTH | FTW_PHYS);
+}
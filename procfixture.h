@@ -0,0 +1,28 @@
+#ifndef PROCFIXTURE_H
+#define PROCFIXTURE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef enum {
+    // every process is the child of the previous one
+    FIXTURE_CHAIN,
+    // every process is a child of PID 1
+    FIXTURE_FAN,
+    // every process is the child of a random earlier one
+    FIXTURE_TREE,
+} FixtureShape;
+
+/**
+ * Build a fake proc root in the existing directory `root`, with PIDs 1 to
+ * `count` arranged in `shape`. Each process gets a `stat` file. Returns
+ * false on I/O errors.
+ */
+bool proc_fixture_build(const char *root, FixtureShape shape, int32_t count);
+
+/**
+ * Delete `root` and everything below it.
+ */
+void proc_fixture_remove(const char *root);
+
+#endif /* PROCFIXTURE_H */
@@ -0,0 +1,94 @@
+#ifndef RING_H
+#define RING_H
+
+#include <assert.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// assumed size of a cache line, to keep the two sides' indices apart
+#define RING_CACHE_LINE 64
+
+/**
+ * Lock-free ring buffer of fixed-size elements, between exactly one
+ * producer and one consumer thread. Each side caches the other's index and
+ * only rereads it when the ring looks full or empty, so that the shared
+ * cache lines don't bounce on every element.
+ */
+typedef struct {
+    // owned by the consumer
+    _Atomic uint32_t head;
+    uint32_t cached_tail;
+    uint8_t pad0[RING_CACHE_LINE - 2 * sizeof(uint32_t)];
+
+    // owned by the producer
+    _Atomic uint32_t tail;
+    uint32_t cached_head;
+    uint8_t pad1[RING_CACHE_LINE - 2 * sizeof(uint32_t)];
+
+    uint8_t *elements;
+    uint32_t mask;
+    uint32_t element_size;
+} Ring;
+
+/**
+ * Initialize `ring` for `capacity` elements, which must be a power of two.
+ * Returns false if out of memory.
+ */
+static inline bool
+ring_init(Ring *ring, uint32_t capacity, uint32_t element_size) {
+    assert(capacity > 0 && (capacity & (capacity - 1)) == 0);
+    memset(ring, 0, sizeof(*ring));
+    ring->elements = calloc(capacity, element_size);
+    ring->mask = capacity - 1;
+    ring->element_size = element_size;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    return ring->elements != NULL;
+}
+
+static inline void
+ring_free(Ring *ring) {
+    free(ring->elements);
+    ring->elements = NULL;
+}
+
+/**
+ * Append a copy of `element`. Producer only; returns false if the ring is
+ * full, i.e. the consumer fell behind.
+ */
+static inline bool
+ring_push(Ring *ring, const void *element) {
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    if (tail - ring->cached_head > ring->mask) {
+        ring->cached_head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        if (tail - ring->cached_head > ring->mask) {
+            return false;
+        }
+    }
+    memcpy(ring->elements + (size_t) (tail & ring->mask) * ring->element_size, element, ring->element_size);
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+/**
+ * Take the oldest element into `element`. Consumer only; returns false if
+ * the ring is empty.
+ */
+static inline bool
+ring_pop(Ring *ring, void *element) {
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head == ring->cached_tail) {
+        ring->cached_tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        if (head == ring->cached_tail) {
+            return false;
+        }
+    }
+    memcpy(element, ring->elements + (size_t) (head & ring->mask) * ring->element_size, ring->element_size);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    return true;
+}
+
+#endif /* RING_H */
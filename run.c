@@ -1,15 +1,39 @@
+#define _GNU_SOURCE
 #include <assert.h>
 #include <ctype.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include <string.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
 #include <X11/Xlib.h>
+#include <X11/Xlib-xcb.h>
+#include <X11/extensions/Xrandr.h>
+#include <xcb/xcb.h>
 #include <pulse/pulseaudio.h>
-#include <x86intrin.h>
+
+#include "backend.h"
+#include "cgroup.h"
+#include "hash.h"
+#include "layout.h"
+#include "mock.h"
+#include "pan.h"
+#include "process.h"
+#include "ring.h"
+#include "stats.h"
+#include "trace.h"
 
 #define ARENA_IMPLEMENTATION
 #include "arena.h"
 
+#define HASH_IMPLEMENTATION
+#include "hash.h"
+
 #define ABORT(msg) do { fprintf(stderr, "%s:%d (%s): " msg "\n", __FILE__, __LINE__, __func__); __builtin_trap(); } while (0);
 
 #define NOT_IMPLEMENTED() ABORT("not implemented")
@@ -21,139 +45,962 @@
 #define MAX(x, y) (((x) >= (y)) ? (x) : (y))
 #endif
 
-int32_t get_children_recursive(Arena *arena, pid_t parent, pid_t **children);
+#ifndef MIN
+#define MIN(x, y) (((x) <= (y)) ? (x) : (y))
+#endif
+
+struct SinkInput;
+
+/**
+ * Entry of the ancestry index: `input` belongs to a descendant of process
+ * `pid`.
+ */
+typedef struct AncestryLink {
+    pid_t pid;
+    struct SinkInput *input;
+    // neighbours below the same `pid`, so that unlinking doesn't have to
+    // search lists which, for PID 1 and session ancestors, hold every sink
+    // input
+    struct AncestryLink *next;
+    struct AncestryLink *prev;
+} AncestryLink;
+
+// maximum depth of the process hierarchy considered for a sink input
+#define MAX_ANCESTRY_DEPTH 64
 
 typedef struct SinkInput {
     unsigned int sink_input_index;
     pid_t pid;
+    // owning client, for resolving `pid` once the client's info arrives
+    uint32_t client;
+    // the user's volume, which panning is applied to; replies carrying our
+    // own panned volume never overwrite it
     pa_cvolume true_volume;
+    // gains for the stream's channel map, NULL until its info arrived
+    const PanTable *pan;
+    // position of the window last panned to, to pan again after the user
+    // changed `true_volume`
+    bool has_position;
+    PanPosition position;
+
+    // last volume we sent to the server, to skip redundant updates; the
+    // target when ramping
+    bool has_applied_volume;
+    pa_cvolume applied_volume;
+
+    // ramping from `ramp_volume`, the last step sent, to `applied_volume`
+    bool ramping;
+    pa_cvolume ramp_volume;
+    uint64_t ramp_received_at;
+    struct SinkInput *next_ramping;
+
+    // at most one volume operation per sink input is in flight; newer
+    // targets replace `pending_volume` and are sent once it completes
+    void *volume_op;
+    bool volume_pending;
+    pa_cvolume pending_volume;
+    // waiting for a free slot under `MAX_VOLUME_OPS_IN_FLIGHT`
+    bool volume_deferred;
+    struct SinkInput *next_deferred;
+    struct SinkInputs *owner;
+
+    // stats timestamps: receipt of the X event behind the pending volume and
+    // behind the one in flight, and submission of the latter
+    uint64_t pending_received_at;
+    uint64_t op_received_at;
+    uint64_t op_submitted_at;
+
+    // how long until a volume we send becomes audible: the stream's buffer
+    // and sink latency, plus how long operations take to apply, smoothed
+    pa_usec_t latency_usec;
+    pa_usec_t apply_usec;
+
+    // CHANGE events until then are taken to be echoes of our own volume
+    // operations
+    pa_usec_t echo_until;
+    // waiting for its info to be refetched, see `queue_refetch`
+    bool refetch;
+    struct SinkInput *next_refetch;
+
+    // next sink input of the same process
+    struct SinkInput *next_same_pid;
+    // one link per ancestor of `pid`, up to the root of the process tree
+    AncestryLink *ancestry;
+    int32_t ancestry_depth;
+    // cgroup of `pid` when matching by cgroup and it is the application's
+    // own, NULL otherwise
+    const Cgroup *cgroup;
+    struct SinkInput *next_same_cgroup;
+    // next unused slot
+    struct SinkInput *next_free;
 } SinkInput;
 
-#define NUM_MAX_SINK_INPUTS 1024
+// sink inputs are allocated in chunks, so that their addresses are stable
+#define SINK_INPUT_CHUNK_SIZE 64
+
+typedef struct SinkInputChunk {
+    struct SinkInputChunk *next;
+    SinkInput slots[SINK_INPUT_CHUNK_SIZE];
+} SinkInputChunk;
+
+// maximum number of volume operations in flight across all sink inputs
+#define MAX_VOLUME_OPS_IN_FLIGHT 16
+// CHANGE events this long after a volume operation completed are taken to
+// be caused by it
+#define ECHO_WINDOW_USEC (50 * PA_USEC_PER_MSEC)
+// CHANGE events are collected this long before refetching sink input infos
+#define REFETCH_DELAY_USEC (20 * PA_USEC_PER_MSEC)
+// refetch the whole list rather than this many sink inputs one by one
+#define REFETCH_LIST_THRESHOLD 8
+// time a ramp takes from silence to full volume or back
+#define RAMP_FULL_SCALE_USEC (200 * PA_USEC_PER_MSEC)
+
+typedef struct SinkInputs {
+    SinkInputChunk *chunks;
+    SinkInput *free_list;
+    int32_t count;
+
+    // where volume operations go
+    AudioBackend *backend;
+
+    int32_t volume_ops_in_flight;
+    // sink inputs with a pending volume but no free slot, oldest first
+    SinkInput *deferred_head;
+    SinkInput *deferred_tail;
+
+    // sink inputs whose info is to be refetched
+    SinkInput *refetch_head;
+    int32_t num_refetch;
+
+    // shared tick stepping all ramping sink inputs, NULL if volumes jump
+    // straight to their targets
+    pa_mainloop_api *api;
+    pa_time_event *ramp_timer;
+    bool ramp_armed;
+    pa_usec_t ramp_interval;
+    // maximum change of a channel per tick
+    pa_volume_t ramp_step;
+    SinkInput *ramping_head;
+
+    // sink input index -> SinkInput*
+    HashMap by_index;
+    // PID -> SinkInput*, further ones linked via `next_same_pid`
+    HashMap by_pid;
+    // cgroup id -> SinkInput*, further ones linked via `next_same_cgroup`
+    HashMap by_cgroup;
+} SinkInputs;
+
+/**
+ * Per-window state, used to coalesce bursts of ConfigureNotify events.
+ */
+typedef struct WindowState {
+    Window window;
+
+    // latest geometry not yet turned into a balance update
+    bool pending;
+    XConfigureEvent latest;
+    struct WindowState *next_pending;
+    // stats timestamp of the first event since the last flush
+    uint64_t received_at;
+    // time of the latest event
+    pa_usec_t latest_at;
+
+    // time of the last balance update, for rate limiting
+    pa_usec_t last_update;
+
+    // for predicting motion: position at the last balance update, the
+    // time of the event it came from, and the smoothed rates of change
+    float sample_balance;
+    float sample_front;
+    pa_usec_t sample_at;
+    float balance_rate;
+    float front_rate;
+    // sent with a predicted position, to be corrected once it stops
+    bool moving;
+    pa_usec_t settle_at;
+    struct WindowState *next_moving;
+
+    // cached result of `find_window_pid`, -1 if the window has none
+    bool pid_known;
+    pid_t pid;
+    // child window the PID was read from, if not from the window itself
+    Window pid_child;
+    // for such child windows, the top-level window whose PID they provide
+    Window toplevel;
+} WindowState;
+
+// atoms interned once at startup
+typedef struct {
+    Atom net_wm_pid;
+    Atom net_wm_name;
+    Atom utf8_string;
+} Atoms;
+
+typedef struct {
+    // maximum number of balance updates per second and window, 0 = no limit
+    float max_update_rate;
+    // pan moving windows ahead to where they will be once the volume is
+    // audible
+    bool predict;
+    // ticks per second of volume ramps, 0 = no ramps
+    float ramp_rate;
+    // match windows and sink inputs by cgroup where it is the
+    // application's own, rather than by process ancestry
+    bool cgroups;
+} Config;
+
+// where a window is and, when predicting, where it is heading
+typedef struct {
+    float balance;
+    float front;
+    // change per second
+    float balance_rate;
+    float front_rate;
+} WindowMotion;
+
+// events further apart than this don't make up one motion
+#define PREDICT_MAX_GAP_USEC (100 * PA_USEC_PER_MSEC)
+// without events for this long, a window is taken to have stopped
+#define PREDICT_SETTLE_USEC (50 * PA_USEC_PER_MSEC)
+// upper bound of how far ahead to predict, against overshooting wildly
+#define PREDICT_MAX_LOOKAHEAD_USEC (500 * PA_USEC_PER_MSEC)
+// weight of the newest rate of change in the smoothed one
+#define PREDICT_SMOOTHING 0.5f
 
 typedef struct {
-    bool pulse_initialized;
+    Config config;
 
     pa_context *context;
+    // NULL when running the threaded pipeline
     pa_mainloop *main_loop;
-    SinkInput sink_inputs[NUM_MAX_SINK_INPUTS];
+    // API of whichever main loop the sound server side runs on
+    pa_mainloop_api *api;
+    SinkInputs sink_inputs;
+
+    Display *display;
+    // the same connection, for pipelined requests
+    xcb_connection_t *xcb;
+    Atoms atoms;
+    Window root;
+    // first event number of XRandR, -1 if the extension is missing
+    int randr_event_base;
+    // monitor geometry, refreshed on RRScreenChangeNotify only
+    Layout layout;
+    // gain tables by channel map, shared by all streams with the same one
+    PanTables pan_tables;
+    // Window -> WindowState*
+    HashMap windows;
+    // windows with a pending geometry, flushed after each drain of X events
+    WindowState *pending_windows;
+    // windows last panned ahead of their position
+    WindowState *moving_windows;
+    // fires when rate-limited windows become due
+    pa_time_event *flush_timer;
+    // fires when sink input infos are to be refetched, NULL when replaying
+    pa_time_event *refetch_timer;
+    bool refetch_armed;
+
+    // scratch memory of the X side, cleared after each drain of X events
+    Arena temp;
+    // scratch memory of the sound server side, only used between
+    // `arena_save` and `arena_restore`
+    Arena audio_temp;
+
+    // long-lived process tree, kept up to date by the proc connector or,
+    // failing that, by periodic rescans
+    ProcessTree processes;
+    Arena process_arena;
+    // PID -> AncestryLink*, the sink inputs of all descendants of that
+    // process
+    HashMap ancestry;
+
+    // client index -> PID, stored in the pointer; clients without a PID
+    // are left out
+    HashMap client_pids;
+
+    // cgroups of windows and sink inputs, NULL unless matching by cgroup
+    CgroupCache *cgroups;
+
+    // provider of `sink_inputs.backend`
+    AudioBackend backend;
+
+    // recording of the events driving the engine, `file` is NULL if off
+    TraceWriter trace;
+
+    // stages and queues of the threaded pipeline, NULL if single-threaded
+    struct Pipeline *pipeline;
+
+    // set on SIGINT or SIGTERM in the single-threaded loop, which from then
+    // on only waits for the volume resets to be acknowledged
+    bool quitting;
+    int32_t resets_pending;
 } State;
 
+// balance update from the X thread for the sound server thread
+typedef struct {
+    pid_t pid;
+    WindowMotion motion;
+    uint64_t received_at;
+} PanRequest;
+
+// result of a rescan by the resolver thread
+typedef struct {
+    // malloc'ed, `count` PIDs followed by as many parent PIDs
+    pid_t *pids;
+    int32_t count;
+} ProcessSnapshot;
+
+#define PIPELINE_PAN_CAPACITY 4096
+#define PIPELINE_SNAPSHOT_CAPACITY 4
+// how soon the X thread retries balance updates which didn't fit
+#define PIPELINE_RETRY_USEC PA_USEC_PER_MSEC
+
+/**
+ * Threaded pipeline: the main thread drains X events and turns them into
+ * PanRequests, the resolver thread does the slow /proc scans, and the
+ * sound server side runs on the thread of a pa_threaded_mainloop. The
+ * stages only share the rings, so a stall in one of them never blocks the
+ * others.
+ */
+typedef struct Pipeline {
+    pa_threaded_mainloop *main_loop;
+    // X thread -> sound server thread
+    Ring pans;
+    // resolver thread -> sound server thread
+    Ring snapshots;
+    // eventfd, signalled after pushing to either ring
+    int wakeup_fd;
+
+    bool resolver_started;
+    pthread_t resolver;
+    // wakes the resolver for a rescan, on request or periodically
+    pthread_mutex_t resolver_lock;
+    pthread_cond_t resolver_cond;
+    bool rescan_requested;
+    bool periodic_rescans;
+
+    // volume resets still running at exit
+    int32_t resets_pending;
+} Pipeline;
+
+static void
+pipeline_wake(Pipeline *pipeline) {
+    uint64_t one = 1;
+    ssize_t ret = write(pipeline->wakeup_fd, &one, sizeof(one));
+    (void) ret;
+}
+
+// how often to rescan /proc when the proc connector is unavailable
+#define PROCESS_RESCAN_INTERVAL_USEC PA_USEC_PER_SEC
+// retry of a snapshot which didn't fit into the ring
+#define RESOLVER_RETRY_USEC (10 * PA_USEC_PER_MSEC)
+
 static void state_init(State *state) {
     memset(state, 0, sizeof(*state));
 
-    state->pulse_initialized = false;
+    hash_map_init(&state->windows, 8);
+    hash_map_init(&state->sink_inputs.by_index, 6);
+    hash_map_init(&state->sink_inputs.by_pid, 6);
+    hash_map_init(&state->sink_inputs.by_cgroup, 6);
+    hash_map_init(&state->ancestry, 8);
+    hash_map_init(&state->client_pids, 6);
+    state->sink_inputs.backend = &state->backend;
+    state->randr_event_base = -1;
+    layout_init(&state->layout);
 
-    for (int i = 0; i < NUM_MAX_SINK_INPUTS; i++) {
-        state->sink_inputs[i].sink_input_index = PA_INVALID_INDEX;
-        state->sink_inputs[i].pid = -1;
+    size_t arena_size = 1024 * 1024;
+    arena_init(&state->audio_temp, calloc(arena_size, 1), arena_size);
+}
+
+static void
+record_processes(State *state) {
+    ProcessTree *tree = &state->processes;
+    ArenaMark mark = arena_save(&state->audio_temp);
+    pid_t *pids;
+    pid_t *parents;
+    uint32_t count = process_tree_snapshot(tree, &state->audio_temp, &pids, &parents);
+    trace_begin(&state->trace, TRACE_PROCESSES, sizeof(count) + 2 * count * sizeof(pid_t));
+    trace_append(&state->trace, &count, sizeof(count));
+    trace_append(&state->trace, pids, count * sizeof(*pids));
+    trace_append(&state->trace, parents, count * sizeof(*parents));
+    arena_restore(&state->audio_temp, mark);
+}
+
+static void
+record_process(State *state, TraceType type, pid_t pid, pid_t parent_pid) {
+    if (state->trace.file) {
+        TraceProcess record = { .pid = pid, .parent_pid = parent_pid };
+        trace_write(&state->trace, type, &record, sizeof(record));
+    }
+}
+
+static void
+record_window(State *state, TraceType type, Window window) {
+    if (state->trace.file) {
+        TraceWindow record = { .window = window };
+        trace_write(&state->trace, type, &record, sizeof(record));
+    }
+}
+
+static void
+record_sink_input(State *state, SinkInput *input, const pa_cvolume *volume) {
+    if (!state->trace.file) {
+        return;
+    }
+
+    TraceSinkInput record = {
+        .index = input->sink_input_index,
+        .pid = input->pid,
+        .channels = volume->channels,
+    };
+    uint32_t values_size = record.channels * sizeof(record.values[0]);
+    trace_begin(&state->trace, TRACE_SINK_INPUT, sizeof(record) + values_size);
+    trace_append(&state->trace, &record, sizeof(record));
+    trace_append(&state->trace, volume->values, values_size);
+}
+
+static void
+record_sink_input_pid(State *state, TraceType type, unsigned int index, pid_t pid) {
+    if (state->trace.file) {
+        TraceSinkInputPid record = { .index = index, .pid = pid };
+        trace_write(&state->trace, type, &record, sizeof(record));
     }
 }
 
 /**
- * Attempt to allocate a new SinkInput inside `state`.
+ * Allocate a new SinkInput for `index` inside `state`.
  */
 static SinkInput *
-add_sink_input(State *state) {
+add_sink_input(State *state, unsigned int index) {
     LOG("New sink input requested");
-    for (int i = 0; i < NUM_MAX_SINK_INPUTS; i++) {
-        if (state->sink_inputs[i].sink_input_index == PA_INVALID_INDEX) {
-            assert(state->sink_inputs[i].pid == -1);
-            return &state->sink_inputs[i];
+    SinkInputs *inputs = &state->sink_inputs;
+    if (!inputs->free_list) {
+        SinkInputChunk *chunk = calloc(1, sizeof(*chunk));
+        assert(chunk);
+        chunk->next = inputs->chunks;
+        inputs->chunks = chunk;
+        for (int i = SINK_INPUT_CHUNK_SIZE - 1; i >= 0; i--) {
+            chunk->slots[i].sink_input_index = PA_INVALID_INDEX;
+            chunk->slots[i].pid = -1;
+            chunk->slots[i].next_free = inputs->free_list;
+            inputs->free_list = &chunk->slots[i];
         }
     }
-    return NULL;
+
+    SinkInput *input = inputs->free_list;
+    inputs->free_list = input->next_free;
+    input->next_free = NULL;
+    assert(input->sink_input_index == PA_INVALID_INDEX);
+    assert(input->pid == -1);
+
+    input->sink_input_index = index;
+    input->owner = inputs;
+    hash_map_put(&inputs->by_index, index, input);
+    inputs->count++;
+    return input;
 }
 
 static SinkInput *
 get_sink_input(State *state, unsigned int index) {
-    for (int i = 0; i < NUM_MAX_SINK_INPUTS; i++) {
-        if (state->sink_inputs[i].sink_input_index == index) {
-            return &state->sink_inputs[i];
+    return hash_map_get(&state->sink_inputs.by_index, index);
+}
+
+/**
+ * Returns the first sink input of process `pid`; the others are linked via
+ * `next_same_pid`.
+ */
+static SinkInput *
+get_sink_input_by_pid(State *state, pid_t pid) {
+    return hash_map_get(&state->sink_inputs.by_pid, (uint32_t) pid);
+}
+
+static void
+unindex_sink_input_ancestry(State *state, SinkInput *input) {
+    for (int32_t i = 0; i < input->ancestry_depth; i++) {
+        AncestryLink *link = &input->ancestry[i];
+        if (link->prev) {
+            link->prev->next = link->next;
+        } else if (link->next) {
+            hash_map_put(&state->ancestry, (uint32_t) link->pid, link->next);
+        } else {
+            hash_map_remove(&state->ancestry, (uint32_t) link->pid);
+        }
+        if (link->next) {
+            link->next->prev = link->prev;
         }
     }
-    return NULL;
+    free(input->ancestry);
+    input->ancestry = NULL;
+    input->ancestry_depth = 0;
 }
 
-static SinkInput *
-get_sink_input_by_pid(State *state, int pid) {
-    for (int i = 0; i < NUM_MAX_SINK_INPUTS; i++) {
-        if (state->sink_inputs[i].pid == pid) {
-            return &state->sink_inputs[i];
+/**
+ * Resolve the ancestor chain of the sink input's process once, and register
+ * the sink input under each ancestor, so that finding the sink inputs below
+ * a window's PID is a single lookup.
+ */
+static void
+index_sink_input_ancestry(State *state, SinkInput *input) {
+    unindex_sink_input_ancestry(state, input);
+    if (input->pid == -1) {
+        return;
+    }
+
+    // the process itself is covered by `by_pid`, so skip it
+    pid_t ancestors[MAX_ANCESTRY_DEPTH + 1];
+    int32_t depth = process_tree_get_ancestors(
+            &state->processes, input->pid, ancestors, MAX_ANCESTRY_DEPTH + 1) - 1;
+    if (depth <= 0) {
+        return;
+    }
+    input->ancestry = calloc(depth, sizeof(*input->ancestry));
+    assert(input->ancestry);
+    input->ancestry_depth = depth;
+
+    for (int32_t i = 0; i < depth; i++) {
+        AncestryLink *link = &input->ancestry[i];
+        link->pid = ancestors[i + 1];
+        link->input = input;
+        link->next = hash_map_get(&state->ancestry, (uint32_t) link->pid);
+        if (link->next) {
+            link->next->prev = link;
         }
+        hash_map_put(&state->ancestry, (uint32_t) link->pid, link);
+    }
+}
+
+static void
+unindex_sink_input_cgroup(State *state, SinkInput *input) {
+    if (!input->cgroup) {
+        return;
+    }
+    HashMap *by_cgroup = &state->sink_inputs.by_cgroup;
+    SinkInput *first = hash_map_get(by_cgroup, input->cgroup->id);
+    if (first == input) {
+        if (input->next_same_cgroup) {
+            hash_map_put(by_cgroup, input->cgroup->id, input->next_same_cgroup);
+        } else {
+            hash_map_remove(by_cgroup, input->cgroup->id);
+        }
+    } else {
+        for (SinkInput *it = first; it; it = it->next_same_cgroup) {
+            if (it->next_same_cgroup == input) {
+                it->next_same_cgroup = input->next_same_cgroup;
+                break;
+            }
+        }
+    }
+    input->next_same_cgroup = NULL;
+    input->cgroup = NULL;
+}
+
+/**
+ * Register the sink input under the cgroup of its process, if that is the
+ * application's own, so that windows of the same application find it with
+ * a single lookup.
+ */
+static void
+index_sink_input_cgroup(State *state, SinkInput *input) {
+    unindex_sink_input_cgroup(state, input);
+    if (!state->cgroups || input->pid == -1) {
+        return;
+    }
+    const Cgroup *cgroup = cgroup_of(state->cgroups, input->pid);
+    if (!cgroup || !cgroup->own) {
+        return;
+    }
+    HashMap *by_cgroup = &state->sink_inputs.by_cgroup;
+    input->cgroup = cgroup;
+    input->next_same_cgroup = hash_map_get(by_cgroup, cgroup->id);
+    hash_map_put(by_cgroup, cgroup->id, input);
+}
+
+/**
+ * Look up the cgroups of all sink inputs again, e.g. after processes may
+ * have been moved between cgroups.
+ */
+static void
+reindex_sink_input_cgroups(State *state) {
+    for (SinkInputChunk *chunk = state->sink_inputs.chunks; chunk; chunk = chunk->next) {
+        for (int i = 0; i < SINK_INPUT_CHUNK_SIZE; i++) {
+            SinkInput *input = &chunk->slots[i];
+            if (input->sink_input_index != PA_INVALID_INDEX && input->pid != -1) {
+                index_sink_input_cgroup(state, input);
+            }
+        }
+    }
+}
+
+static void
+unlink_sink_input_pid(State *state, SinkInput *input) {
+    if (input->pid == -1) {
+        return;
+    }
+    SinkInputs *inputs = &state->sink_inputs;
+    unindex_sink_input_ancestry(state, input);
+    unindex_sink_input_cgroup(state, input);
+
+    SinkInput *first = hash_map_get(&inputs->by_pid, (uint32_t) input->pid);
+    if (first == input) {
+        if (input->next_same_pid) {
+            hash_map_put(&inputs->by_pid, (uint32_t) input->pid, input->next_same_pid);
+        } else {
+            hash_map_remove(&inputs->by_pid, (uint32_t) input->pid);
+        }
+    } else {
+        for (SinkInput *it = first; it; it = it->next_same_pid) {
+            if (it->next_same_pid == input) {
+                it->next_same_pid = input->next_same_pid;
+                break;
+            }
+        }
+    }
+    input->next_same_pid = NULL;
+    input->pid = -1;
+}
+
+static void
+set_sink_input_pid(State *state, SinkInput *input, pid_t pid) {
+    SinkInputs *inputs = &state->sink_inputs;
+    unlink_sink_input_pid(state, input);
+    if (pid == -1) {
+        return;
+    }
+
+    input->pid = pid;
+    input->next_same_pid = hash_map_get(&inputs->by_pid, (uint32_t) pid);
+    hash_map_put(&inputs->by_pid, (uint32_t) pid, input);
+    index_sink_input_ancestry(state, input);
+    index_sink_input_cgroup(state, input);
+}
+
+/**
+ * Process tree hook: record forks and reparented orphans, so that replays
+ * see the same tree without a snapshot per change.
+ */
+static void
+process_tree_reparented(void *userdata, pid_t pid, pid_t parent_pid) {
+    record_process(userdata, TRACE_PROCESS_PARENT, pid, parent_pid);
+}
+
+/**
+ * Process tree hook: re-resolve the ancestries which contained the exited
+ * process `pid`, or all of them after a rescan (pid == -1).
+ */
+static void
+process_tree_changed(void *userdata, pid_t pid) {
+    State *state = userdata;
+    if (state->trace.file) {
+        if (pid == -1) {
+            record_processes(state);
+        } else {
+            record_process(state, TRACE_PROCESS_EXIT, pid, -1);
+        }
+    }
+    if (state->cgroups) {
+        // the PID may get reused, or processes moved after a rescan
+        if (pid == -1) {
+            cgroup_cache_clear(state->cgroups);
+            reindex_sink_input_cgroups(state);
+        } else {
+            cgroup_cache_forget(state->cgroups, pid);
+        }
+    }
+    if (pid == -1) {
+        for (SinkInputChunk *chunk = state->sink_inputs.chunks; chunk; chunk = chunk->next) {
+            for (int i = 0; i < SINK_INPUT_CHUNK_SIZE; i++) {
+                SinkInput *input = &chunk->slots[i];
+                if (input->sink_input_index != PA_INVALID_INDEX && input->pid != -1) {
+                    index_sink_input_ancestry(state, input);
+                }
+            }
+        }
+        return;
+    }
+
+    // collect first, as re-indexing modifies the list; sink inputs of `pid`
+    // itself are about to be removed anyway
+    int32_t count = 0;
+    for (AncestryLink *link = hash_map_get(&state->ancestry, (uint32_t) pid); link; link = link->next) {
+        count++;
+    }
+    if (count == 0) {
+        return;
+    }
+    ArenaMark mark = arena_save(&state->audio_temp);
+    SinkInput **inputs = ARENA_ALLOC_ARRAY_EX(&state->audio_temp, SinkInput *, count, ARENA_NOZERO);
+    int32_t i = 0;
+    for (AncestryLink *link = hash_map_get(&state->ancestry, (uint32_t) pid); link; link = link->next) {
+        inputs[i++] = link->input;
+    }
+    for (i = 0; i < count; i++) {
+        index_sink_input_ancestry(state, inputs[i]);
+    }
+    arena_restore(&state->audio_temp, mark);
+}
+
+static void volume_callback(pa_context *context, int success, void *userdata);
+void adjust_volume_for_sink_input(SinkInput *input, PanPosition position, uint64_t received_at);
+
+/**
+ * Send the pending volume of `input`, which has no operation in flight.
+ */
+static void
+send_pending_volume(SinkInput *input) {
+    input->volume_pending = false;
+    input->op_received_at = input->pending_received_at;
+    input->op_submitted_at = stats_now();
+    stats_record(STAGE_SUBMIT, input->op_submitted_at - input->op_received_at);
+    AudioBackend *backend = input->owner->backend;
+    input->volume_op = backend->set_sink_input_volume(
+            backend,
+            input->sink_input_index,
+            &input->pending_volume,
+            volume_callback,
+            input);
+    if (input->volume_op) {
+        input->owner->volume_ops_in_flight++;
+    }
+}
+
+static void
+defer_volume(SinkInputs *inputs, SinkInput *input) {
+    input->volume_deferred = true;
+    input->next_deferred = NULL;
+    if (inputs->deferred_tail) {
+        inputs->deferred_tail->next_deferred = input;
+    } else {
+        inputs->deferred_head = input;
+    }
+    inputs->deferred_tail = input;
+}
+
+static void
+undefer_volume(SinkInputs *inputs, SinkInput *input) {
+    SinkInput *prev = NULL;
+    for (SinkInput *it = inputs->deferred_head; it; prev = it, it = it->next_deferred) {
+        if (it == input) {
+            if (prev) {
+                prev->next_deferred = it->next_deferred;
+            } else {
+                inputs->deferred_head = it->next_deferred;
+            }
+            if (inputs->deferred_tail == it) {
+                inputs->deferred_tail = prev;
+            }
+            break;
+        }
+    }
+    input->volume_deferred = false;
+    input->next_deferred = NULL;
+}
+
+/**
+ * Hand free slots to deferred sink inputs, oldest first.
+ */
+static void
+send_deferred_volumes(SinkInputs *inputs) {
+    while (inputs->deferred_head && inputs->volume_ops_in_flight < MAX_VOLUME_OPS_IN_FLIGHT) {
+        SinkInput *input = inputs->deferred_head;
+        undefer_volume(inputs, input);
+        if (input->volume_pending && !input->volume_op) {
+            send_pending_volume(input);
+        }
+    }
+}
+
+static void
+volume_callback(pa_context *context, int success, void *userdata) {
+    (void) context;
+    SinkInput *input = userdata;
+    SinkInputs *inputs = input->owner;
+    if (success) {
+        uint64_t now = stats_now();
+        stats_record(STAGE_APPLY, now - input->op_submitted_at);
+        stats_record(STAGE_END_TO_END, now - input->op_received_at);
+        pa_usec_t apply_usec = (now - input->op_submitted_at) / 1000;
+        input->apply_usec = input->apply_usec ? (7 * input->apply_usec + apply_usec) / 8 : apply_usec;
+    } else {
+        LOGF("setting volume of sink input %u failed", input->sink_input_index);
+    }
+
+    inputs->backend->release(inputs->backend, input->volume_op);
+    input->volume_op = NULL;
+    inputs->volume_ops_in_flight--;
+    input->echo_until = pa_rtclock_now() + ECHO_WINDOW_USEC;
+
+    // a target that arrived meanwhile goes to the back of the queue if
+    // others are waiting, so that one busy stream can't starve the rest
+    if (input->volume_pending) {
+        if (inputs->deferred_head) {
+            defer_volume(inputs, input);
+        } else {
+            send_pending_volume(input);
+        }
+    }
+    send_deferred_volumes(inputs);
+}
+
+/**
+ * Set the volume of `input`, superseding any target which wasn't sent yet.
+ * Operations already sent can't be taken back by the server, so a newer
+ * target waits for them instead of queueing up behind them.
+ */
+static void
+request_volume(SinkInput *input, const pa_cvolume *volume, uint64_t received_at) {
+    SinkInputs *inputs = input->owner;
+    memcpy(&input->pending_volume, volume, sizeof(*volume));
+    input->pending_received_at = received_at;
+    input->volume_pending = true;
+    if (input->volume_op || input->volume_deferred) {
+        return;
+    }
+    if (inputs->volume_ops_in_flight >= MAX_VOLUME_OPS_IN_FLIGHT) {
+        defer_volume(inputs, input);
+        return;
+    }
+    send_pending_volume(input);
+}
+
+/**
+ * Drop the pending volume and the operation in flight of `input`, e.g.
+ * because its slot is about to be reused.
+ */
+static void
+cancel_volume(State *state, SinkInput *input) {
+    SinkInputs *inputs = &state->sink_inputs;
+    if (input->volume_deferred) {
+        undefer_volume(inputs, input);
+    }
+    input->volume_pending = false;
+    if (input->volume_op) {
+        // no callback after this, which would refer to the reused slot
+        inputs->backend->cancel(inputs->backend, input->volume_op);
+        input->volume_op = NULL;
+        inputs->volume_ops_in_flight--;
+        send_deferred_volumes(inputs);
     }
-    return NULL;
 }
 
 static void
 remove_sink_input(State *state, unsigned int index) {
     LOGF("removing sink input %u", index);
-    for (int i = 0; i < NUM_MAX_SINK_INPUTS; i++) {
-        SinkInput *input = &state->sink_inputs[i];
-        if (input->sink_input_index == index) {
-            input->sink_input_index = PA_INVALID_INDEX;
-            input->pid = -1;
-            memset(&input->true_volume, 0, sizeof(input->true_volume));
-            break;
+    SinkInputs *inputs = &state->sink_inputs;
+    SinkInput *input = hash_map_remove(&inputs->by_index, index);
+    if (!input) {
+        return;
+    }
+
+    unlink_sink_input_pid(state, input);
+    cancel_volume(state, input);
+    if (input->refetch) {
+        for (SinkInput **it = &inputs->refetch_head; *it; it = &(*it)->next_refetch) {
+            if (*it == input) {
+                *it = input->next_refetch;
+                inputs->num_refetch--;
+                break;
+            }
         }
     }
+    if (input->ramping) {
+        for (SinkInput **it = &inputs->ramping_head; *it; it = &(*it)->next_ramping) {
+            if (*it == input) {
+                *it = input->next_ramping;
+                break;
+            }
+        }
+    }
+    memset(input, 0, sizeof(*input));
+    input->sink_input_index = PA_INVALID_INDEX;
+    input->pid = -1;
+    input->next_free = inputs->free_list;
+    inputs->free_list = input;
+    inputs->count--;
 }
 
 void
 debug_print_sink_inputs(State *state) {
     LOG("------------------------------------------------------------");
-    for (int i = 0; i < NUM_MAX_SINK_INPUTS; i++) {
-        if (state->sink_inputs[i].sink_input_index != PA_INVALID_INDEX) {
-            LOGF("{ .index = %u, .pid = %d }",
-                    state->sink_inputs[i].sink_input_index,
-                    state->sink_inputs[i].pid);
+    for (SinkInputChunk *chunk = state->sink_inputs.chunks; chunk; chunk = chunk->next) {
+        for (int i = 0; i < SINK_INPUT_CHUNK_SIZE; i++) {
+            SinkInput *input = &chunk->slots[i];
+            if (input->sink_input_index != PA_INVALID_INDEX) {
+                LOGF("{ .index = %u, .pid = %d }",
+                        input->sink_input_index,
+                        input->pid);
+            }
         }
     }
     LOG("------------------------------------------------------------");
 }
 
+/**
+ * Look up the state of `window`, creating it if `create` is set.
+ */
+static WindowState *
+get_window_state(State *state, Window window, bool create) {
+    WindowState *ws = hash_map_get(&state->windows, window);
+    if (!ws && create) {
+        ws = calloc(1, sizeof(*ws));
+        assert(ws);
+        ws->window = window;
+        hash_map_put(&state->windows, window, ws);
+    }
+    return ws;
+}
+
+static void
+remove_window_state(State *state, Window window) {
+    WindowState *ws = hash_map_remove(&state->windows, window);
+    if (!ws) {
+        return;
+    }
+
+    if (ws->pid_child) {
+        remove_window_state(state, ws->pid_child);
+    }
+    if (ws->pending) {
+        for (WindowState **it = &state->pending_windows; *it; it = &(*it)->next_pending) {
+            if (*it == ws) {
+                *it = ws->next_pending;
+                break;
+            }
+        }
+    }
+    if (ws->moving) {
+        for (WindowState **it = &state->moving_windows; *it; it = &(*it)->next_moving) {
+            if (*it == ws) {
+                *it = ws->next_moving;
+                break;
+            }
+        }
+    }
+    free(ws);
+}
+
 static bool
-get_first_child(Display *d, Window w, Window *child) {
-    Window root, parent, *children = NULL;
-    unsigned int nchildren = 0;
-    XQueryTree(d, w, &root, &parent, &children, &nchildren);
-    if (nchildren > 0) {
-        *child = children[0];
-        XFree(children);
-        return true;
-    } else {
-        return false;
+get_first_child(xcb_connection_t *conn, Window w, Window *child) {
+    xcb_query_tree_reply_t *reply = xcb_query_tree_reply(conn, xcb_query_tree(conn, w), NULL);
+    bool found = false;
+    if (reply && xcb_query_tree_children_length(reply) > 0) {
+        *child = xcb_query_tree_children(reply)[0];
+        found = true;
     }
+    free(reply);
+    return found;
 }
 
+/**
+ * Extract the PID from a _NET_WM_PID reply, and free it.
+ */
 static pid_t
-get_window_pid(Display *display, Window window) {
-    Atom actual_type_return;
-    int actual_format_return;
-    unsigned long nitems_return;
-    unsigned long bytes_after_return;
-    int *prop_return;
-
-    Atom property = XInternAtom(display, "_NET_WM_PID", 1);
-    int ret = XGetWindowProperty(
-            display,
-            window,
-            property,
-            0,
-            1,
-            False,
-            AnyPropertyType,
-            &actual_type_return,
-            &actual_format_return,
-            &nitems_return,
-            &bytes_after_return,
-            (unsigned char **) &prop_return);
-    assert(ret == Success);
-    if (!prop_return) {
-        return -1;
-    } else {
-        return *prop_return;
+get_property_pid(xcb_get_property_reply_t *reply) {
+    pid_t pid = -1;
+    if (reply && reply->format == 32 && xcb_get_property_value_length(reply) >= 4) {
+        pid = (pid_t) *(uint32_t *) xcb_get_property_value(reply);
     }
+    free(reply);
+    return pid;
 }
 
 void
@@ -174,74 +1021,185 @@ debug_dump_properties(Display *d, Window w) {
     XFree(props);
 }
 
+/**
+ * Returns the window's _NET_WM_NAME as a malloc'ed string, or NULL.
+ */
 static char *
-get_window_name(Display *display, Window window) {
-    Atom actual_type_return;
-    int actual_format_return;
-    unsigned long nitems_return;
-    unsigned long bytes_after_return;
-    unsigned char *prop_return = NULL;
-
-    Atom property = XInternAtom(display, "_NET_WM_NAME", 1);
-    int ret = XGetWindowProperty(
-            display,
-            window,
-            property,
-            0,
-            1024,
-            False,
-            XInternAtom(display, "UTF8_STRING", True),
-            &actual_type_return,
-            &actual_format_return,
-            &nitems_return,
-            &bytes_after_return,
-            &prop_return);
-
-    assert(ret == Success);
-    return (char *) prop_return;
+get_window_name(xcb_connection_t *conn, Atoms *atoms, Window window) {
+    xcb_get_property_cookie_t cookie = xcb_get_property(
+            conn, 0, window, atoms->net_wm_name, atoms->utf8_string, 0, 1024);
+    xcb_get_property_reply_t *reply = xcb_get_property_reply(conn, cookie, NULL);
+    char *name = NULL;
+    if (reply && xcb_get_property_value_length(reply) > 0) {
+        name = strndup(xcb_get_property_value(reply), xcb_get_property_value_length(reply));
+    }
+    free(reply);
+    return name;
 }
 
 static char *
-find_window_name(Display *display, Window window) {
-    char *name = get_window_name(display, window);
+find_window_name(xcb_connection_t *conn, Atoms *atoms, Window window) {
+    char *name = get_window_name(conn, atoms, window);
     if (name) {
         return name;
     }
 
     Window first_child;
-    if (get_first_child(display, window, &first_child)) {
-        return get_window_name(display, first_child);
+    if (get_first_child(conn, window, &first_child)) {
+        return get_window_name(conn, atoms, first_child);
     } else {
         return NULL;
     }
 }
 
-static pid_t
-find_window_pid(Display *display, Window window) {
-    pid_t pid = get_window_pid(display, window);
-    if (pid != -1) {
-        return pid;
+static void
+set_window_pid(State *state, WindowState *ws, pid_t pid, Window child) {
+    ws->pid = pid;
+    ws->pid_known = true;
+    if (state->trace.file) {
+        TraceWindowPid record = { .window = ws->window, .pid = pid };
+        trace_write(&state->trace, TRACE_WINDOW_PID, &record, sizeof(record));
     }
 
-    Window child;
-    if (get_first_child(display, window, &child)) {
-        return get_window_pid(display, child);
-    } else {
-        return -1;
+    if (ws->pid_child && ws->pid_child != child) {
+        Window old_child = ws->pid_child;
+        ws->pid_child = 0;
+        remove_window_state(state, old_child);
+    }
+    if (child) {
+        // tracked so that PropertyNotify on the child finds its top-level
+        WindowState *cs = get_window_state(state, child, true);
+        cs->toplevel = ws->window;
+        ws->pid_child = child;
     }
 }
 
-#if 0
+/**
+ * Resolve the PIDs of a batch of top-level windows, falling back to their
+ * first child for reparenting window managers. All requests of a stage are
+ * pipelined, so the whole batch costs at most two round trips. Every window
+ * queried gets PropertyChangeMask selected beforehand, so that changes of
+ * _NET_WM_PID can invalidate the cached results.
+ */
 static void
-server_info_callback(pa_context *context, const pa_server_info *si, void *userdata) {
-    (void) context;
-    (void) userdata;
-    (void) si;
-    LOG("got server info.");
-}
-#endif
+resolve_window_pids(State *state, WindowState **windows, int32_t count) {
+    xcb_connection_t *conn = state->xcb;
+    Arena *arena = &state->temp;
+    ArenaMark mark = arena_save(arena);
+    uint32_t event_mask = XCB_EVENT_MASK_PROPERTY_CHANGE;
+
+    xcb_get_property_cookie_t *pid_cookies =
+        ARENA_ALLOC_ARRAY_EX(arena, xcb_get_property_cookie_t, count, ARENA_NOZERO);
+    xcb_query_tree_cookie_t *tree_cookies =
+        ARENA_ALLOC_ARRAY_EX(arena, xcb_query_tree_cookie_t, count, ARENA_NOZERO);
+    xcb_get_property_cookie_t *child_cookies =
+        ARENA_ALLOC_ARRAY_EX(arena, xcb_get_property_cookie_t, count, ARENA_NOZERO);
+    Window *children = ARENA_ALLOC_ARRAY(arena, Window, count);
+
+    // The children are queried speculatively, so windows without a PID of
+    // their own don't need an extra round trip to find their child.
+    for (int32_t i = 0; i < count; i++) {
+        Window w = windows[i]->window;
+        xcb_change_window_attributes(conn, w, XCB_CW_EVENT_MASK, &event_mask);
+        pid_cookies[i] = xcb_get_property(
+                conn, 0, w, state->atoms.net_wm_pid, XCB_GET_PROPERTY_TYPE_ANY, 0, 1);
+        tree_cookies[i] = xcb_query_tree(conn, w);
+    }
 
-void
+    for (int32_t i = 0; i < count; i++) {
+        xcb_generic_error_t *error = NULL;
+        pid_t pid = get_property_pid(xcb_get_property_reply(conn, pid_cookies[i], &error));
+        free(error);
+
+        error = NULL;
+        xcb_query_tree_reply_t *tree = xcb_query_tree_reply(conn, tree_cookies[i], &error);
+        free(error);
+        if (pid == -1 && tree && xcb_query_tree_children_length(tree) > 0) {
+            Window child = xcb_query_tree_children(tree)[0];
+            xcb_change_window_attributes(conn, child, XCB_CW_EVENT_MASK, &event_mask);
+            child_cookies[i] = xcb_get_property(
+                    conn, 0, child, state->atoms.net_wm_pid, XCB_GET_PROPERTY_TYPE_ANY, 0, 1);
+            children[i] = child;
+        } else {
+            set_window_pid(state, windows[i], pid, 0);
+        }
+        free(tree);
+    }
+
+    for (int32_t i = 0; i < count; i++) {
+        if (children[i]) {
+            xcb_generic_error_t *error = NULL;
+            pid_t pid = get_property_pid(xcb_get_property_reply(conn, child_cookies[i], &error));
+            free(error);
+            set_window_pid(state, windows[i], pid, children[i]);
+        }
+    }
+
+    arena_restore(arena, mark);
+}
+
+static void
+invalidate_window_pid(State *state, Window window) {
+    WindowState *ws = get_window_state(state, window, false);
+    if (!ws) {
+        return;
+    }
+    ws->pid_known = false;
+    if (ws->toplevel) {
+        WindowState *toplevel = get_window_state(state, ws->toplevel, false);
+        if (toplevel) {
+            toplevel->pid_known = false;
+        }
+    }
+}
+
+/**
+ * Intern all atoms we need with a single round trip.
+ */
+static void
+intern_atoms(xcb_connection_t *conn, Atoms *atoms) {
+    static const char *names[] = { "_NET_WM_PID", "_NET_WM_NAME", "UTF8_STRING" };
+    Atom *results[] = { &atoms->net_wm_pid, &atoms->net_wm_name, &atoms->utf8_string };
+    enum { NUM_ATOMS = sizeof(names) / sizeof(names[0]) };
+
+    xcb_intern_atom_cookie_t cookies[NUM_ATOMS];
+    for (int i = 0; i < NUM_ATOMS; i++) {
+        cookies[i] = xcb_intern_atom(conn, 0, strlen(names[i]), names[i]);
+    }
+    for (int i = 0; i < NUM_ATOMS; i++) {
+        xcb_intern_atom_reply_t *reply = xcb_intern_atom_reply(conn, cookies[i], NULL);
+        assert(reply);
+        *results[i] = reply->atom;
+        free(reply);
+    }
+}
+
+/**
+ * Windows can disappear at any time, in particular between an event and our
+ * requests about them, so don't let Xlib's default handler exit on that.
+ */
+static int
+x_error_handler(Display *display, XErrorEvent *error) {
+    if (error->error_code == BadWindow) {
+        return 0;
+    }
+    char text[256];
+    XGetErrorText(display, error->error_code, text, sizeof(text));
+    LOGF("X error: %s (request %d)", text, error->request_code);
+    return 0;
+}
+
+#if 0
+static void
+server_info_callback(pa_context *context, const pa_server_info *si, void *userdata) {
+    (void) context;
+    (void) userdata;
+    (void) si;
+    LOG("got server info.");
+}
+#endif
+
+void
 debug_dump_proplist(pa_proplist *list) {
     void *state = NULL;
     const char *key = NULL;
@@ -250,33 +1208,61 @@ debug_dump_proplist(pa_proplist *list) {
     }
 }
 
+/**
+ * Parse `application.process.id` from `proplist`. Returns false if it is
+ * missing or not a valid PID.
+ */
+static bool
+get_proplist_pid(pa_proplist *proplist, pid_t *pid) {
+    const char *value = proplist ? pa_proplist_gets(proplist, PA_PROP_APPLICATION_PROCESS_ID) : NULL;
+    if (!value || !*value) {
+        return false;
+    }
+
+    pid_t result = 0;
+    for (const char *it = value; *it; it++) {
+        if (!isdigit((unsigned char) *it) || result > (INT32_MAX - 9) / 10) {
+            return false;
+        }
+        result = result * 10 + (*it - '0');
+    }
+    if (result <= 0) {
+        return false;
+    }
+    *pid = result;
+    return true;
+}
+
+/**
+ * Cache the PID of a client, from the initial client list or a client
+ * subscription event, and hand it to sink inputs which were waiting for it.
+ */
 static void
 client_info_callback(pa_context *context, const pa_client_info *ci, int eol, void *userdata) {
     (void) context;
-    (void) eol;
-
-    if (!ci) {
-        // why are we called?
+    if (eol || !ci) {
         return;
     }
 
-    SinkInput *input = userdata;
-    assert(input);
-    LOGF("Got client_info for sink_index = %u", input->sink_input_index);
-    const void *data = NULL;
-    size_t nbytes = 0;
-    int found_key = pa_proplist_get(
-            ci->proplist,
-            PA_PROP_APPLICATION_PROCESS_ID,
-            &data, &nbytes
-            ) == 0;
-
-    if (found_key) {
-        // TODO: verify is integer
-        int pid = atoi(data);
-
-        LOGF("Setting PID for sink_index = %u to %d", input->sink_input_index, pid);
-        input->pid = pid;
+    State *state = userdata;
+    pid_t pid;
+    if (!get_proplist_pid(ci->proplist, &pid)) {
+        return;
+    }
+    hash_map_put(&state->client_pids, ci->index, (void *) (intptr_t) pid);
+
+    for (SinkInputChunk *chunk = state->sink_inputs.chunks; chunk; chunk = chunk->next) {
+        for (int i = 0; i < SINK_INPUT_CHUNK_SIZE; i++) {
+            SinkInput *input = &chunk->slots[i];
+            if (input->sink_input_index != PA_INVALID_INDEX
+                    && input->pid == -1
+                    && input->client == ci->index)
+            {
+                LOGF("Setting PID for sink_index = %u to %d", input->sink_input_index, pid);
+                set_sink_input_pid(state, input, pid);
+                record_sink_input_pid(state, TRACE_SINK_INPUT_PID, input->sink_input_index, pid);
+            }
+        }
     }
 }
 
@@ -293,23 +1279,96 @@ operation_callback(pa_operation *op, void *_user) {
     }
 }
 
+static void *
+pulse_set_sink_input_volume(AudioBackend *backend, uint32_t index,
+        const pa_cvolume *volume, pa_context_success_cb_t done, void *userdata)
+{
+    return pa_context_set_sink_input_volume(backend->userdata, index, volume, done, userdata);
+}
+
+static void
+pulse_release(AudioBackend *backend, void *op) {
+    (void) backend;
+    pa_operation_unref(op);
+}
+
+static void
+pulse_cancel(AudioBackend *backend, void *op) {
+    (void) backend;
+    pa_operation_cancel(op);
+    pa_operation_unref(op);
+}
+
+static void
+pulse_get_sink_input_info(AudioBackend *backend, uint32_t index, pa_sink_input_info_cb_t cb, void *userdata) {
+    pa_operation *op = pa_context_get_sink_input_info(backend->userdata, index, cb, userdata);
+    pa_operation_set_state_callback(op, operation_callback, NULL);
+}
+
+static void
+pulse_get_sink_input_info_list(AudioBackend *backend, pa_sink_input_info_cb_t cb, void *userdata) {
+    pa_operation *op = pa_context_get_sink_input_info_list(backend->userdata, cb, userdata);
+    pa_operation_set_state_callback(op, operation_callback, NULL);
+}
+
+static void
+pulse_get_client_info(AudioBackend *backend, uint32_t index, pa_client_info_cb_t cb, void *userdata) {
+    pa_operation *op = pa_context_get_client_info(backend->userdata, index, cb, userdata);
+    pa_operation_set_state_callback(op, operation_callback, NULL);
+}
+
 static void
-init_sink_input(SinkInput *input, pa_context *context, const pa_sink_input_info *sii) {
-    input->sink_input_index = sii->index;
+pulse_get_client_info_list(AudioBackend *backend, pa_client_info_cb_t cb, void *userdata) {
+    pa_operation *op = pa_context_get_client_info_list(backend->userdata, cb, userdata);
+    pa_operation_set_state_callback(op, operation_callback, NULL);
+}
+
+static void
+pulse_subscribe(AudioBackend *backend, pa_subscription_mask_t mask,
+        pa_context_subscribe_cb_t cb, void *userdata)
+{
+    pa_context_set_subscribe_callback(backend->userdata, cb, userdata);
+    pa_operation *op = pa_context_subscribe(backend->userdata, mask, NULL, NULL);
+    pa_operation_set_state_callback(op, operation_callback, NULL);
+}
+
+static void
+init_pulse_backend(AudioBackend *backend, pa_context *context) {
+    *backend = (AudioBackend) {
+        .userdata = context,
+        .set_sink_input_volume = pulse_set_sink_input_volume,
+        .release = pulse_release,
+        .cancel = pulse_cancel,
+        .get_sink_input_info = pulse_get_sink_input_info,
+        .get_sink_input_info_list = pulse_get_sink_input_info_list,
+        .get_client_info = pulse_get_client_info,
+        .get_client_info_list = pulse_get_client_info_list,
+        .subscribe = pulse_subscribe,
+    };
+}
 
+static void
+init_sink_input(State *state, SinkInput *input, const pa_sink_input_info *sii) {
     // update the volume?
     memcpy(&input->true_volume, &sii->volume, sizeof(sii->volume));
 
-    // if PID not yet set (i.e. new sink input), request client info from
-    // which PID will be determined
+    // if PID not yet set (i.e. new sink input), take it from the stream's
+    // own properties, which usually carry the client's, or else from the
+    // client cache; failing both, `client_info_callback` sets it once the
+    // client's info arrives
     if (input->pid == -1) {
-        if (sii->client != PA_INVALID_INDEX) {
-            LOGF("Requesting client info for sink input %d", sii->index);
-            pa_operation *op = pa_context_get_client_info(
-                    context, sii->client, client_info_callback, input);
-            pa_operation_set_state_callback(op, operation_callback, NULL);
-        }
-        else {
+        input->client = sii->client;
+        pid_t pid;
+        void *cached;
+        if (get_proplist_pid(sii->proplist, &pid)) {
+            set_sink_input_pid(state, input, pid);
+        } else if (sii->client != PA_INVALID_INDEX
+                && (cached = hash_map_get(&state->client_pids, sii->client)))
+        {
+            set_sink_input_pid(state, input, (pid_t) (intptr_t) cached);
+        } else if (sii->client != PA_INVALID_INDEX) {
+            LOGF("Waiting for client info of sink input %d", sii->index);
+        } else {
             LOGF("WARNING: sink input %d has no client set; cannot determine PID!",
                     sii->index);
         }
@@ -321,6 +1380,124 @@ init_sink_input(SinkInput *input, pa_context *context, const pa_sink_input_info
 
 }
 
+/**
+ * Refetch the info of `input` once its volume settled, to pick up changes
+ * made by others, e.g. the user changing its volume. Infos are fetched at
+ * most once per REFETCH_DELAY_USEC, and not while our own volume operations
+ * are in flight or their echoes are due, so that a drag costs a single
+ * refetch at its end.
+ */
+static void
+queue_refetch(State *state, SinkInput *input) {
+    if (!state->refetch_timer) {
+        return;
+    }
+    SinkInputs *inputs = &state->sink_inputs;
+    if (!input->refetch) {
+        input->refetch = true;
+        input->next_refetch = inputs->refetch_head;
+        inputs->refetch_head = input;
+        inputs->num_refetch++;
+    }
+    if (!state->refetch_armed) {
+        struct timeval tv;
+        pa_timeval_add(pa_gettimeofday(&tv), REFETCH_DELAY_USEC);
+        state->api->time_restart(state->refetch_timer, &tv);
+        state->refetch_armed = true;
+    }
+}
+
+static bool
+volume_settled(SinkInput *input, pa_usec_t now) {
+    return !input->volume_op && !input->volume_pending && !input->ramping && now >= input->echo_until;
+}
+
+static void sink_input_info_callback(pa_context *context, const pa_sink_input_info *sii, int eol, void *_state);
+static void ramp_tick_callback(pa_mainloop_api *api, pa_time_event *e, const struct timeval *tv, void *userdata);
+
+static void
+refetch_timer_callback(pa_mainloop_api *api, pa_time_event *e, const struct timeval *tv, void *userdata) {
+    (void) tv;
+    State *state = userdata;
+    SinkInputs *inputs = &state->sink_inputs;
+    AudioBackend *backend = &state->backend;
+    state->refetch_armed = false;
+
+    pa_usec_t now = pa_rtclock_now();
+    int32_t num_settled = 0;
+    for (SinkInput *input = inputs->refetch_head; input; input = input->next_refetch) {
+        num_settled += volume_settled(input, now);
+    }
+    // a storm of changes is cheaper to pick up in one go
+    bool fetch_list = num_settled >= REFETCH_LIST_THRESHOLD;
+    if (fetch_list) {
+        backend->get_sink_input_info_list(backend, sink_input_info_callback, state);
+    }
+
+    SinkInput **it = &inputs->refetch_head;
+    while (*it) {
+        SinkInput *input = *it;
+        if (!volume_settled(input, now)) {
+            it = &input->next_refetch;
+            continue;
+        }
+        *it = input->next_refetch;
+        input->next_refetch = NULL;
+        input->refetch = false;
+        inputs->num_refetch--;
+        if (!fetch_list) {
+            backend->get_sink_input_info(backend, input->sink_input_index, sink_input_info_callback, state);
+        }
+    }
+
+    if (inputs->refetch_head) {
+        struct timeval next;
+        pa_timeval_add(pa_gettimeofday(&next), REFETCH_DELAY_USEC);
+        api->time_restart(e, &next);
+        state->refetch_armed = true;
+    }
+}
+
+/**
+ * Take over the volume the server reported for `input`. Unless it is the
+ * one we applied, the user changed the volume of the panned stream, so
+ * their volume is scaled by as much and panned again.
+ */
+static void
+update_true_volume(State *state, SinkInput *input, const pa_cvolume *reported) {
+    if (!input->has_applied_volume) {
+        memcpy(&input->true_volume, reported, sizeof(*reported));
+        return;
+    }
+    if (input->volume_op || input->volume_pending || input->ramping) {
+        // outdated by our own operations, check again once they completed
+        queue_refetch(state, input);
+        return;
+    }
+    if (pa_cvolume_equal(reported, &input->applied_volume)) {
+        return;
+    }
+
+    pa_volume_t applied_max = pa_cvolume_max(&input->applied_volume);
+    if (reported->channels != input->true_volume.channels || applied_max == 0) {
+        memcpy(&input->true_volume, reported, sizeof(*reported));
+    } else {
+        pa_volume_t reported_max = pa_cvolume_max(reported);
+        for (unsigned channel = 0; channel < input->true_volume.channels; channel++) {
+            uint64_t value = (uint64_t) input->true_volume.values[channel] * reported_max / applied_max;
+            input->true_volume.values[channel] = (pa_volume_t) MIN(value, PA_VOLUME_MAX);
+        }
+    }
+    LOGF("volume of sink input %u changed externally", input->sink_input_index);
+    // ramps continue from the volume the user set
+    memcpy(&input->ramp_volume, reported, sizeof(*reported));
+
+    input->has_applied_volume = false;
+    if (input->has_position) {
+        adjust_volume_for_sink_input(input, input->position, stats_now());
+    }
+}
+
 static void
 sink_input_info_callback(
         pa_context *context,
@@ -328,32 +1505,42 @@ sink_input_info_callback(
         int eol,
         /* (State *) */ void *_state)
 {
+    (void) context;
     (void) eol;
     if (!sii) return;
 
     State *state = _state;
     SinkInput *input = get_sink_input(state, sii->index);
     if (!input) {
-        input = add_sink_input(state);
-        init_sink_input(input, context, sii);
+        input = add_sink_input(state, sii->index);
+        init_sink_input(state, input, sii);
+    } else {
+        update_true_volume(state, input, &sii->volume);
     }
-    LOGF("got sink_input_info_callback, setting true_volume = { .left = %d, .right = %d }",
-            sii->volume.values[0],
-            sii->volume.values[1]);
-    memcpy(&input->true_volume, &sii->volume, sizeof(sii->volume));
+    input->latency_usec = sii->buffer_usec + sii->sink_usec;
+
+    pa_channel_map map = sii->channel_map;
+    if (map.channels != sii->volume.channels) {
+        pa_channel_map_init_auto(&map, sii->volume.channels, PA_CHANNEL_MAP_DEFAULT);
+    }
+    if (!input->pan || !pa_channel_map_equal(&input->pan->map, &map)) {
+        input->pan = pan_table_get(&state->pan_tables, &map);
+    }
+    record_sink_input(state, input, &sii->volume);
 }
 
 static void
-get_initial_sink_inputs(pa_context *context, State *state) {
-#if 0
-    printf("Requesting initial server info...\n");
-    pa_context_get_server_info(context, server_info_callback, userdata);
-#endif
+get_initial_sink_inputs(State *state) {
+    AudioBackend *backend = &state->backend;
+    // clients first, so that their PIDs are known when the sink inputs arrive
+    printf("Requesting initial client info...\n");
+    backend->get_client_info_list(backend, client_info_callback, state);
     printf("Requesting initial sink input info...\n");
-    pa_context_get_sink_input_info_list(context, sink_input_info_callback, state);
+    backend->get_sink_input_info_list(backend, sink_input_info_callback, state);
 }
 
 static void sub_callback(pa_context *context, pa_subscription_event_type_t t, uint32_t idx, void *userdata) {
+    (void) context;
     int facility = t & PA_SUBSCRIPTION_EVENT_FACILITY_MASK;
     int event = t & PA_SUBSCRIPTION_EVENT_TYPE_MASK;
 
@@ -379,17 +1566,25 @@ static void sub_callback(pa_context *context, pa_subscription_event_type_t t, ui
         default: event_str = "UNKNOWN"; break;
     }
 
-    if (facility == PA_SUBSCRIPTION_EVENT_SINK_INPUT) {
+    if (facility == PA_SUBSCRIPTION_EVENT_CLIENT) {
         State *state = userdata;
-        if (event == PA_SUBSCRIPTION_EVENT_NEW || event == PA_SUBSCRIPTION_EVENT_CHANGE) {
-            pa_operation *op = pa_context_get_sink_input_info(
-                    context,
-                    idx,
-                    sink_input_info_callback,
-                    state
-                    );
-            pa_operation_set_state_callback(op, operation_callback, NULL);
+        if (event == PA_SUBSCRIPTION_EVENT_NEW) {
+            state->backend.get_client_info(&state->backend, idx, client_info_callback, state);
+        } else if (event == PA_SUBSCRIPTION_EVENT_REMOVE) {
+            hash_map_remove(&state->client_pids, idx);
+        }
+    } else if (facility == PA_SUBSCRIPTION_EVENT_SINK_INPUT) {
+        State *state = userdata;
+        if (event == PA_SUBSCRIPTION_EVENT_NEW) {
+            state->backend.get_sink_input_info(&state->backend, idx, sink_input_info_callback, state);
+        } else if (event == PA_SUBSCRIPTION_EVENT_CHANGE) {
+            // sink inputs not known yet are fetched after their NEW event
+            SinkInput *input = get_sink_input(state, idx);
+            if (input) {
+                queue_refetch(state, input);
+            }
         } else if (event == PA_SUBSCRIPTION_EVENT_REMOVE) {
+            record_sink_input_pid(state, TRACE_SINK_INPUT_REMOVE, idx, -1);
             remove_sink_input(state, idx);
         }
     }
@@ -401,6 +1596,29 @@ static void sub_callback(pa_context *context, pa_subscription_event_type_t t, ui
 #endif
 }
 
+/**
+ * Start tracking sink inputs, once the backend is ready.
+ */
+static void
+start_audio(State *state) {
+    AudioBackend *backend = &state->backend;
+    pa_mainloop_api *api = state->api;
+    state->refetch_timer = api->time_new(api, NULL, refetch_timer_callback, state);
+    assert(state->refetch_timer);
+    if (state->config.ramp_rate > 0.0f) {
+        SinkInputs *inputs = &state->sink_inputs;
+        inputs->api = api;
+        inputs->ramp_interval = (pa_usec_t) (PA_USEC_PER_SEC / state->config.ramp_rate);
+        inputs->ramp_step = MAX(1, (uint64_t) PA_VOLUME_NORM * inputs->ramp_interval / RAMP_FULL_SCALE_USEC);
+        inputs->ramp_timer = api->time_new(api, NULL, ramp_tick_callback, inputs);
+        assert(inputs->ramp_timer);
+    }
+    backend->subscribe(backend,
+            PA_SUBSCRIPTION_MASK_SINK_INPUT | PA_SUBSCRIPTION_MASK_CLIENT,
+            sub_callback, state);
+    get_initial_sink_inputs(state);
+}
+
 static void
 context_state_callback(pa_context *context, void *userdata) {
     switch (pa_context_get_state(context)) {
@@ -418,9 +1636,7 @@ context_state_callback(pa_context *context, void *userdata) {
         break; /**< The client is passing its application name to the daemon */
     case PA_CONTEXT_READY:
         printf("PA_CONTEXT_READY");
-        pa_context_set_subscribe_callback(context, sub_callback, userdata);
-        pa_context_subscribe(context, PA_SUBSCRIPTION_MASK_SINK_INPUT, NULL, userdata);
-        get_initial_sink_inputs(context, (State *) userdata);
+        start_audio((State *) userdata);
         break; /**< The connection is established, the context is ready to execute operations */
     case PA_CONTEXT_FAILED:
         printf("PA_CONTEXT_FAILED");
@@ -433,172 +1649,1525 @@ context_state_callback(pa_context *context, void *userdata) {
 }
 
 /**
- * balance: left-right-balance, from 0.0f (only left) to 1.0f (only right)
+ * Move each channel of `volume` towards `target` by at most `step`.
+ * Returns true once they are equal.
  */
-void adjust_volume_for_sink_input(pa_context *context, SinkInput *input, float balance) {
-    pa_cvolume volume;
-    memcpy(&volume, &input->true_volume, sizeof(volume));
-    if (volume.channels >= 2) {
-#if 0
-        pa_volume_t total = input->true_volume.values[0] + input->true_volume.values[1];
-        pa_volume_t left  = (1.0f - balance) * total;
-        pa_volume_t right = balance * total;
-#else
-        pa_volume_t max = MAX(input->true_volume.values[0], input->true_volume.values[1]);
-        pa_volume_t left = (balance > 0.5f) ? ((1.0f - balance) * max) : max;
-        pa_volume_t right = (balance > 0.5f) ? max : (balance * max);
-#endif
-        volume.values[0] = left;
-        volume.values[1] = right;
-
-        pa_operation *op = pa_context_set_sink_input_volume(
-                context,
-                input->sink_input_index,
-                &volume,
-                NULL,
-                NULL);
-        pa_operation_set_state_callback(op, operation_callback, NULL);
+static bool
+step_volume(pa_cvolume *volume, const pa_cvolume *target, pa_volume_t step) {
+    if (volume->channels != target->channels) {
+        *volume = *target;
+        return true;
     }
+    bool reached = true;
+    for (unsigned channel = 0; channel < volume->channels; channel++) {
+        pa_volume_t from = volume->values[channel];
+        pa_volume_t to = target->values[channel];
+        if (from < to) {
+            volume->values[channel] = to - from > step ? from + step : to;
+        } else if (from > to) {
+            volume->values[channel] = from - to > step ? from - step : to;
+        }
+        reached = reached && volume->values[channel] == to;
+    }
+    return reached;
 }
 
-static inline float
-clampf(float x, float lo, float hi) {
-    if (x < lo) return 0.0f;
-    if (x > hi) return 1.0f;
-    return x;
-}
-
-void adjust_volume(State *state, pa_context *context, pid_t pid, XConfigureEvent conf, Arena *arena) {
-    (void) conf;
+/**
+ * Send the next step of all ramping sink inputs as one batch, and keep
+ * ticking until all of them reached their targets.
+ */
+static void
+ramp_tick_callback(pa_mainloop_api *api, pa_time_event *e, const struct timeval *tv, void *userdata) {
+    (void) tv;
+    SinkInputs *inputs = userdata;
+    SinkInput **it = &inputs->ramping_head;
+    while (*it) {
+        SinkInput *input = *it;
+        bool reached = step_volume(&input->ramp_volume, &input->applied_volume, inputs->ramp_step);
+        request_volume(input, &input->ramp_volume, input->ramp_received_at);
+        if (reached) {
+            *it = input->next_ramping;
+            input->next_ramping = NULL;
+            input->ramping = false;
+        } else {
+            it = &input->next_ramping;
+        }
+    }
 
-    float center = (float) conf.x + (float) conf.width / 2.0f;
-    float balance = clampf((float) center / (2 * 1920), 0.0f, 1.0f);
+    if (inputs->ramping_head) {
+        struct timeval next;
+        api->time_restart(e, pa_timeval_add(pa_gettimeofday(&next), inputs->ramp_interval));
+    } else {
+        inputs->ramp_armed = false;
+    }
+}
 
+/**
+ * Ramp `input` to its new `applied_volume` on the shared tick, starting
+ * with the next one.
+ */
+static void
+start_ramp(SinkInput *input, uint64_t received_at) {
+    SinkInputs *inputs = input->owner;
+    input->ramp_received_at = received_at;
+    if (input->ramping) {
+        return;
+    }
+    if (input->ramp_volume.channels == 0) {
+        // not changed by us yet
+        memcpy(&input->ramp_volume, &input->true_volume, sizeof(input->true_volume));
+    }
+    input->ramping = true;
+    input->next_ramping = inputs->ramping_head;
+    inputs->ramping_head = input;
+
+    if (!inputs->ramp_armed) {
+        struct timeval now;
+        inputs->api->time_restart(inputs->ramp_timer, pa_gettimeofday(&now));
+        inputs->ramp_armed = true;
+    }
+}
 
-    SinkInput *input = get_sink_input_by_pid(state, pid);
-    if (input) {
-        adjust_volume_for_sink_input(context, input, balance);
+/**
+ * Pan each channel of `input` by its speaker's position relative to the
+ * window at `position`.
+ */
+void adjust_volume_for_sink_input(SinkInput *input, PanPosition position, uint64_t received_at) {
+    input->has_position = true;
+    input->position = position;
+    if (input->true_volume.channels < 2 || !input->pan) {
+        return;
     }
+    pa_cvolume volume;
+    pan_apply(input->pan, position, &input->true_volume, &volume);
 
-    //alternative: walk up process hierarchy for each sink input's process
-    //until `pid` is found
+    if (input->has_applied_volume && pa_cvolume_equal(&volume, &input->applied_volume)) {
+        return;
+    }
+    input->has_applied_volume = true;
+    memcpy(&input->applied_volume, &volume, sizeof(volume));
+    if (input->owner->ramp_timer) {
+        start_ramp(input, received_at);
+    } else {
+        request_volume(input, &volume, received_at);
+    }
+}
 
-    // Also check children of `pid` for sink inputs
-    pid_t *children = NULL;
-    /* uint64_t _start = _rdtsc(); */
-    int32_t child_count = get_children_recursive(arena, pid, &children);
-    /* uint64_t _elapsed = _rdtsc() - _start; */
-    /* LOGF("get_process_children() took %lf Mcycles", (float) _elapsed / 1e6); */
+/**
+ * Position of `motion` by the time a volume sent now becomes audible on
+ * `input`.
+ */
+static PanPosition
+predict_position(const WindowMotion *motion, const SinkInput *input) {
+    if (motion->balance_rate == 0.0f && motion->front_rate == 0.0f) {
+        return pan_position(motion->balance, motion->front);
+    }
+    pa_usec_t lookahead = MIN(input->latency_usec + input->apply_usec, PREDICT_MAX_LOOKAHEAD_USEC);
+    float t = (float) lookahead / PA_USEC_PER_SEC;
+    return pan_position(motion->balance + motion->balance_rate * t, motion->front + motion->front_rate * t);
+}
 
-    for (int32_t i = 0; i < child_count; i++) {
-        SinkInput *input = get_sink_input_by_pid(state, children[i]);
-        if (input) {
-            adjust_volume_for_sink_input(context, input, balance);
+/**
+ * Pan the sink inputs of `pid`, of its descendants and, if it is the
+ * application's own, of the cgroup of `pid` to `motion`. The cgroup also
+ * finds streams of processes which were reparented away from `pid`, the
+ * ancestry those which were moved to another cgroup. `received_at` is the
+ * stats timestamp of the X event which caused this.
+ */
+static void
+pan_pid(State *state, pid_t pid, const WindowMotion *motion, uint64_t received_at) {
+    uint64_t start = stats_now();
+    const Cgroup *cgroup = state->cgroups ? cgroup_of(state->cgroups, pid) : NULL;
+    if (cgroup && !cgroup->own) {
+        cgroup = NULL;
+    }
+    SinkInput *same_cgroup = cgroup ? hash_map_get(&state->sink_inputs.by_cgroup, cgroup->id) : NULL;
+    SinkInput *own = get_sink_input_by_pid(state, pid);
+    // sink inputs of all descendants of `pid`
+    AncestryLink *descendants = hash_map_get(&state->ancestry, (uint32_t) pid);
+    uint64_t looked_up = stats_now();
+    stats_record(STAGE_DESCENDANTS, looked_up - start);
+
+    for (SinkInput *input = same_cgroup; input; input = input->next_same_cgroup) {
+        adjust_volume_for_sink_input(input, predict_position(motion, input), received_at);
+    }
+    // skip those already panned via the cgroup, which are exactly the ones
+    // indexed under it
+    for (SinkInput *input = own; input; input = input->next_same_pid) {
+        if (!cgroup || input->cgroup != cgroup) {
+            adjust_volume_for_sink_input(input, predict_position(motion, input), received_at);
+        }
+    }
+    for (AncestryLink *link = descendants; link; link = link->next) {
+        if (!cgroup || link->input->cgroup != cgroup) {
+            adjust_volume_for_sink_input(link->input, predict_position(motion, link->input), received_at);
         }
     }
+    stats_record_since(STAGE_MATCH, looked_up);
 }
 
-// grr, state needs to be global for signal handler...
-// NOTE: the state will _only_ ever be referred to by `global_state`
-// during `exit_handler`.
-// Otherwise, it will _always_ be passed around explicitly.
-State *global_state = NULL;
+/**
+ * Record the latest geometry of a window; balance updates are deferred to
+ * `flush_pending_windows`, so that a burst of events costs a single update.
+ */
+static void
+queue_window_update(State *state, XConfigureEvent *conf) {
+    WindowState *ws = get_window_state(state, conf->window, true);
+    ws->latest = *conf;
+    ws->latest_at = pa_rtclock_now();
+    if (!ws->pending) {
+        ws->pending = true;
+        ws->received_at = stats_now();
+        ws->next_pending = state->pending_windows;
+        state->pending_windows = ws;
+    }
+}
 
+/**
+ * Switch to a new monitor layout and pan all windows with a known geometry
+ * accordingly.
+ */
 static void
-exit_handler(int signo) {
-    // TODO: not working correctly yet
-    (void) signo;
-    printf("terminating.\n");
+set_monitors(State *state, const Monitor *monitors, int32_t count) {
+    layout_set_monitors(&state->layout, monitors, count);
+
+    if (state->trace.file) {
+        uint32_t num_monitors = state->layout.num_monitors;
+        trace_begin(&state->trace, TRACE_MONITORS, sizeof(num_monitors) + num_monitors * sizeof(TraceMonitor));
+        trace_append(&state->trace, &num_monitors, sizeof(num_monitors));
+        for (uint32_t i = 0; i < num_monitors; i++) {
+            const Monitor *monitor = &state->layout.monitors[i];
+            TraceMonitor record = {
+                .x = monitor->x,
+                .y = monitor->y,
+                .width = monitor->width,
+                .height = monitor->height,
+            };
+            memcpy(record.name, monitor->name, sizeof(record.name));
+            trace_append(&state->trace, &record, sizeof(record));
+        }
+    }
 
-    if (global_state && global_state->pulse_initialized) {
-        LOG("hi");
-        for (int i = 0; i < NUM_MAX_SINK_INPUTS; i++) {
-            SinkInput *input = &global_state->sink_inputs[i];
-            if (input->sink_input_index != PA_INVALID_INDEX) {
-                LOGF("resetting volume for sink input %u", input->sink_input_index);
-                // reset volume
-                pa_cvolume volume;
-                memcpy(&volume, &input->true_volume, sizeof(input->true_volume));
-                pa_volume_t total = input->true_volume.values[0] + input->true_volume.values[1];
-                pa_volume_t left  = total / 2.0f;
-                pa_volume_t right = total / 2.0f;
-                volume.values[0] = left;
-                volume.values[1] = right;
+    for (int32_t i = 0; i < (1 << state->windows.exp); i++) {
+        WindowState *ws = state->windows.slots[i].value;
+        if (ws && ws != HASH_MAP_TOMBSTONE && ws->latest.window) {
+            queue_window_update(state, &ws->latest);
+        }
+    }
+}
 
-                pa_operation *op = pa_context_set_sink_input_volume(
-                        global_state->context,
-                        input->sink_input_index,
-                        &volume,
-                        NULL,
-                        NULL);
-                while (pa_operation_get_state(op) == PA_OPERATION_RUNNING) {
-                    pa_mainloop_iterate(global_state->main_loop, 0, NULL);
-                }
-                pa_operation_unref(op);
+/**
+ * Fetch the monitor layout through XRandR, falling back to a single monitor
+ * covering the whole screen.
+ */
+static void
+query_monitors(State *state) {
+    Monitor monitors[LAYOUT_MAX_MONITORS];
+    int32_t count = 0;
+
+    if (state->randr_event_base >= 0) {
+        int num_infos = 0;
+        XRRMonitorInfo *infos = XRRGetMonitors(state->display, state->root, True, &num_infos);
+        for (int i = 0; infos && i < num_infos && count < LAYOUT_MAX_MONITORS; i++) {
+            Monitor *monitor = &monitors[count++];
+            memset(monitor, 0, sizeof(*monitor));
+            monitor->x = infos[i].x;
+            monitor->y = infos[i].y;
+            monitor->width = infos[i].width;
+            monitor->height = infos[i].height;
+            char *name = infos[i].name ? XGetAtomName(state->display, infos[i].name) : NULL;
+            if (name) {
+                snprintf(monitor->name, sizeof(monitor->name), "%s", name);
+                XFree(name);
             }
         }
+        if (infos) {
+            XRRFreeMonitors(infos);
+        }
+    }
 
-        pa_context_disconnect(global_state->context);
+    if (count == 0) {
+        int screen = DefaultScreen(state->display);
+        monitors[0] = (Monitor) {
+            .width = DisplayWidth(state->display, screen),
+            .height = DisplayHeight(state->display, screen),
+        };
+        count = 1;
     }
 
-    exit(0);
+    for (int32_t i = 0; i < count; i++) {
+        LOGF("monitor %s: %dx%d+%d+%d", monitors[i].name, monitors[i].width, monitors[i].height,
+                monitors[i].x, monitors[i].y);
+    }
+    set_monitors(state, monitors, count);
 }
 
+/**
+ * Pan the streams of `ws` to its latest geometry, or hand that over to the
+ * sound server thread. Returns false if its queue is full.
+ */
+static bool
+pan_window(State *state, WindowState *ws) {
+    WindowMotion motion = { 0 };
+    layout_position(&state->layout, ws->latest.x, ws->latest.y, ws->latest.width, ws->latest.height,
+            &motion.balance, &motion.front);
+
+    if (state->config.predict) {
+        // no events since the last update means it stopped
+        pa_usec_t dt = ws->latest_at - ws->sample_at;
+        if (ws->sample_at && ws->latest_at > ws->sample_at && dt <= PREDICT_MAX_GAP_USEC) {
+            float seconds = (float) dt / PA_USEC_PER_SEC;
+            float balance_rate = (motion.balance - ws->sample_balance) / seconds;
+            float front_rate = (motion.front - ws->sample_front) / seconds;
+            ws->balance_rate += PREDICT_SMOOTHING * (balance_rate - ws->balance_rate);
+            ws->front_rate += PREDICT_SMOOTHING * (front_rate - ws->front_rate);
+        } else {
+            ws->balance_rate = 0.0f;
+            ws->front_rate = 0.0f;
+        }
+        ws->sample_balance = motion.balance;
+        ws->sample_front = motion.front;
+        ws->sample_at = ws->latest_at;
+        motion.balance_rate = ws->balance_rate;
+        motion.front_rate = ws->front_rate;
+    }
 
-int
-main() {
-    global_state = malloc(sizeof(*global_state));
-    State *state = global_state;
-    state_init(state);
+    if (state->pipeline) {
+        PanRequest request = {
+            .pid = ws->pid,
+            .motion = motion,
+            .received_at = ws->received_at,
+        };
+        if (!ring_push(&state->pipeline->pans, &request)) {
+            return false;
+        }
+    } else {
+        pan_pid(state, ws->pid, &motion, ws->received_at);
+    }
 
-    signal(SIGINT, exit_handler);
-    signal(SIGTERM, exit_handler);
+    if (motion.balance_rate != 0.0f || motion.front_rate != 0.0f) {
+        ws->settle_at = pa_rtclock_now() + PREDICT_SETTLE_USEC;
+        if (!ws->moving) {
+            ws->moving = true;
+            ws->next_moving = state->moving_windows;
+            state->moving_windows = ws;
+        }
+    }
+    return true;
+}
 
-    pa_mainloop *ml = pa_mainloop_new();
-    assert(ml);
+/**
+ * Send one balance update for each window with a pending geometry, unless it
+ * was updated too recently, in which case the flush timer is armed instead.
+ * PIDs of those windows and of the newly `mapped` ones which aren't cached
+ * yet are resolved together in one batch. Returns when the next window
+ * becomes due, or 0 if none is waiting.
+ */
+static pa_usec_t
+flush_pending_windows(State *state, Window *mapped, int32_t num_mapped) {
+    pa_usec_t now = pa_rtclock_now();
+    pa_usec_t min_interval = 0;
+    if (state->config.max_update_rate > 0.0f) {
+        min_interval = (pa_usec_t) (PA_USEC_PER_SEC / state->config.max_update_rate);
+    }
 
-    pa_mainloop_api *ml_api = pa_mainloop_get_api(ml);
-    assert(ml_api);
+    int32_t capacity = state->windows.count + num_mapped;
+    WindowState **due_windows = ARENA_ALLOC_ARRAY_EX(&state->temp, WindowState *, capacity, ARENA_NOZERO);
+    WindowState **unresolved = ARENA_ALLOC_ARRAY_EX(&state->temp, WindowState *, capacity, ARENA_NOZERO);
+    int32_t num_due = 0;
+    int32_t num_unresolved = 0;
+
+    for (int32_t i = 0; i < num_mapped; i++) {
+        WindowState *ws = get_window_state(state, mapped[i], false);
+        if (ws && !ws->pid_known) {
+            // mark as known to avoid duplicates, resolving overwrites it
+            ws->pid_known = true;
+            unresolved[num_unresolved++] = ws;
+        }
+    }
 
-    pa_context *context = pa_context_new(ml_api, "helloworld");
-    assert(context);
+    pa_usec_t next_due = 0;
 
-    pa_context_set_state_callback(context, context_state_callback, state);
-    assert(pa_context_connect(context, NULL, 0, NULL) >= 0);
+    // windows panned ahead which stopped get their actual position
+    WindowState **moving = &state->moving_windows;
+    while (*moving) {
+        WindowState *ws = *moving;
+        if (ws->pending || now < ws->settle_at) {
+            if (!ws->pending && (!next_due || ws->settle_at < next_due)) {
+                next_due = ws->settle_at;
+            }
+            moving = &ws->next_moving;
+            continue;
+        }
+        *moving = ws->next_moving;
+        ws->next_moving = NULL;
+        ws->moving = false;
+        due_windows[num_due++] = ws;
+    }
 
-    state->context = context;
-    state->main_loop = ml;
-    state->pulse_initialized = true;
+    WindowState **it = &state->pending_windows;
+    while (*it) {
+        WindowState *ws = *it;
+        pa_usec_t due = ws->last_update + min_interval;
+        if (ws->last_update && now < due) {
+            if (!next_due || due < next_due) {
+                next_due = due;
+            }
+            it = &ws->next_pending;
+            continue;
+        }
 
-    // ------------------------------------------------------------
+        *it = ws->next_pending;
+        ws->next_pending = NULL;
+        ws->pending = false;
+        ws->last_update = now;
+
+        stats_record(STAGE_QUEUED, stats_now() - ws->received_at);
+        due_windows[num_due++] = ws;
+        if (!ws->pid_known) {
+            ws->pid_known = true;
+            unresolved[num_unresolved++] = ws;
+        }
+    }
+
+    // without an X connection, i.e. when replaying, PIDs come from the trace
+    if (num_unresolved > 0 && state->xcb) {
+        uint64_t start = stats_now();
+        resolve_window_pids(state, unresolved, num_unresolved);
+        stats_record_since(STAGE_PID_RESOLVE, start);
+    }
+
+    bool submitted = false;
+    for (int32_t i = 0; i < num_due; i++) {
+        WindowState *ws = due_windows[i];
+        if (ws->pid == -1) {
+            continue;
+        }
+        if (pan_window(state, ws)) {
+            submitted = true;
+        } else {
+            // the sound server thread is backed up, keep the update
+            ws->pending = true;
+            ws->last_update = 0;
+            ws->next_pending = state->pending_windows;
+            state->pending_windows = ws;
+            if (!next_due || now + PIPELINE_RETRY_USEC < next_due) {
+                next_due = now + PIPELINE_RETRY_USEC;
+            }
+        }
+    }
+    if (submitted && state->pipeline) {
+        pipeline_wake(state->pipeline);
+    }
+    if (state->trace.file && (num_due > 0 || num_unresolved > 0)) {
+        trace_write(&state->trace, TRACE_FLUSH, NULL, 0);
+    }
+
+    if (next_due && state->flush_timer) {
+        struct timeval tv;
+        pa_timeval_add(pa_gettimeofday(&tv), next_due - now);
+        state->api->time_restart(state->flush_timer, &tv);
+    }
+    return next_due;
+}
+
+static void
+flush_timer_callback(pa_mainloop_api *api, pa_time_event *e, const struct timeval *tv, void *userdata) {
+    (void) api;
+    (void) e;
+    (void) tv;
+    flush_pending_windows(userdata, NULL, 0);
+}
+
+/**
+ * Poll function for the PulseAudio main loop which additionally waits on the
+ * X connection, so that a blocking `pa_mainloop_iterate` wakes up for X
+ * events as well as for PulseAudio replies and timers.
+ */
+static int
+poll_with_display(struct pollfd *ufds, unsigned long nfds, int timeout, void *userdata) {
+    Display *display = userdata;
+
+    // Events which Xlib already read off the socket won't make the fd
+    // readable again, so don't block if there are any queued. This also
+    // flushes our pending requests before we go to sleep.
+    if (XEventsQueued(display, QueuedAfterFlush) > 0) {
+        timeout = 0;
+    }
+
+    struct pollfd fds[nfds + 1];
+    memcpy(fds, ufds, nfds * sizeof(*ufds));
+    fds[nfds].fd = ConnectionNumber(display);
+    fds[nfds].events = POLLIN;
+    fds[nfds].revents = 0;
+
+    int ret = poll(fds, nfds + 1, timeout);
+    memcpy(ufds, fds, nfds * sizeof(*ufds));
+    if (ret > 0 && fds[nfds].revents) {
+        // only report PulseAudio's own fds back to the main loop
+        ret--;
+    }
+    return ret;
+}
+
+static void
+process_rescan_callback(pa_mainloop_api *api, pa_time_event *e, const struct timeval *tv, void *userdata) {
+    (void) tv;
+    State *state = userdata;
+    process_tree_rescan(&state->processes);
+
+    struct timeval next;
+    api->time_restart(e, pa_timeval_add(pa_gettimeofday(&next), PROCESS_RESCAN_INTERVAL_USEC));
+}
+
+/**
+ * CLOCK_MONOTONIC time `usec` from now, for timed waits.
+ */
+static struct timespec
+monotonic_deadline(pa_usec_t usec) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    uint64_t nsec = deadline.tv_nsec + (usec % PA_USEC_PER_SEC) * 1000;
+    deadline.tv_sec += usec / PA_USEC_PER_SEC + nsec / 1000000000;
+    deadline.tv_nsec = nsec % 1000000000;
+    return deadline;
+}
+
+/**
+ * Resolver stage of the pipeline: rescans /proc into a tree of its own and
+ * passes snapshots of it on, so that the scans don't hold up the sound
+ * server thread. Rescans happen periodically without the proc connector,
+ * and whenever the sound server thread's tree needs a resync.
+ */
+static void *
+resolver_thread(void *userdata) {
+    Pipeline *pipeline = userdata;
+    size_t arena_size = 1024 * 1024;
+    Arena arena;
+    arena_init(&arena, calloc(arena_size, 1), arena_size);
+    Arena temp;
+    arena_init(&temp, calloc(arena_size, 1), arena_size);
+    ProcessTree tree;
+    process_tree_init(&tree, &arena);
+
+    bool retry = false;
+    pthread_mutex_lock(&pipeline->resolver_lock);
+    for (;;) {
+        struct timespec deadline = monotonic_deadline(retry ? RESOLVER_RETRY_USEC : PROCESS_RESCAN_INTERVAL_USEC);
+        while (!pipeline->rescan_requested) {
+            if (pipeline->periodic_rescans || retry) {
+                if (pthread_cond_timedwait(&pipeline->resolver_cond, &pipeline->resolver_lock, &deadline)
+                        == ETIMEDOUT)
+                {
+                    break;
+                }
+            } else {
+                pthread_cond_wait(&pipeline->resolver_cond, &pipeline->resolver_lock);
+            }
+        }
+        pipeline->rescan_requested = false;
+        pthread_mutex_unlock(&pipeline->resolver_lock);
+
+        process_tree_rescan(&tree);
+        pid_t *pids;
+        pid_t *parents;
+        int32_t count = process_tree_snapshot(&tree, &temp, &pids, &parents);
+        ProcessSnapshot snapshot = {
+            .pids = malloc(2 * MAX(count, 1) * sizeof(pid_t)),
+            .count = count,
+        };
+        if (snapshot.pids) {
+            memcpy(snapshot.pids, pids, count * sizeof(pid_t));
+            memcpy(snapshot.pids + count, parents, count * sizeof(pid_t));
+        }
+        // if the sound server thread didn't take the previous ones yet, try
+        // again shortly, as a resync waits for this one
+        retry = !snapshot.pids || !ring_push(&pipeline->snapshots, &snapshot);
+        if (retry) {
+            free(snapshot.pids);
+        } else {
+            pipeline_wake(pipeline);
+        }
+        arena_clear(&temp);
+        pthread_mutex_lock(&pipeline->resolver_lock);
+    }
+    return NULL;
+}
+
+/**
+ * Have the resolver thread rescan once right away, or from now on
+ * periodically. Starts it on first use.
+ */
+static void
+request_rescans(Pipeline *pipeline, bool periodic) {
+    pthread_mutex_lock(&pipeline->resolver_lock);
+    if (periodic) {
+        pipeline->periodic_rescans = true;
+    } else {
+        pipeline->rescan_requested = true;
+    }
+    pthread_cond_signal(&pipeline->resolver_cond);
+    pthread_mutex_unlock(&pipeline->resolver_lock);
+
+    if (!pipeline->resolver_started) {
+        int error = pthread_create(&pipeline->resolver, NULL, resolver_thread, pipeline);
+        assert(error == 0);
+        pipeline->resolver_started = true;
+    }
+}
+
+/**
+ * Process tree hook: compaction or events dropped by the proc connector
+ * call for a full rescan, which the resolver thread does instead of the
+ * sound server thread.
+ */
+static void
+process_tree_resync_requested(void *userdata) {
+    State *state = userdata;
+    request_rescans(state->pipeline, false);
+}
+
+static void
+start_process_rescans(State *state, pa_mainloop_api *api) {
+    Pipeline *pipeline = state->pipeline;
+    if (pipeline) {
+        request_rescans(pipeline, true);
+        return;
+    }
+
+    struct timeval next;
+    pa_time_event *e = api->time_new(
+            api,
+            pa_timeval_add(pa_gettimeofday(&next), PROCESS_RESCAN_INTERVAL_USEC),
+            process_rescan_callback,
+            state);
+    assert(e);
+}
+
+static void
+process_events_callback(pa_mainloop_api *api, pa_io_event *e, int fd, pa_io_event_flags_t events, void *userdata) {
+    (void) events;
+    State *state = userdata;
+    if (!process_events_dispatch(&state->processes, fd)) {
+        LOG("proc connector unusable, falling back to periodic rescans");
+        api->io_free(e);
+        close(fd);
+        if (state->pipeline) {
+            request_rescans(state->pipeline, false);
+        } else {
+            process_tree_rescan(&state->processes);
+        }
+        start_process_rescans(state, api);
+    }
+}
+
+/**
+ * Build the process tree once and keep it up to date from fork/exit
+ * notifications, or by rescanning on a timer if those are unavailable.
+ */
+static void
+init_process_tree(State *state) {
+    size_t arena_size = 1024 * 1024;
+    void *memory = calloc(arena_size, 1);
+    arena_init(&state->process_arena, memory, arena_size);
+    process_tree_init(&state->processes, &state->process_arena);
+    state->processes.on_change = process_tree_changed;
+    state->processes.on_parent = process_tree_reparented;
+    if (state->pipeline) {
+        state->processes.on_resync = process_tree_resync_requested;
+    }
+    state->processes.userdata = state;
+}
+
+static void
+cgroup_events_callback(pa_mainloop_api *api, pa_io_event *e, int fd, pa_io_event_flags_t events, void *userdata) {
+    (void) api;
+    (void) e;
+    (void) fd;
+    (void) events;
+    State *state = userdata;
+    if (cgroup_watch_dispatch(state->cgroups)) {
+        reindex_sink_input_cgroups(state);
+    }
+}
+
+/**
+ * Match by cgroup from now on, watching the cgroup tree for applications
+ * being moved into scopes of their own if inotify is available. Processes
+ * in shared cgroups are still matched by ancestry.
+ */
+static void
+start_cgroup_tracking(State *state, pa_mainloop_api *api) {
+    state->cgroups = calloc(1, sizeof(*state->cgroups));
+    assert(state->cgroups);
+    cgroup_cache_init(state->cgroups);
+
+    int fd = cgroup_watch_open(state->cgroups);
+    if (fd >= 0) {
+        pa_io_event *e = api->io_new(api, fd, PA_IO_EVENT_INPUT, cgroup_events_callback, state);
+        assert(e);
+    } else {
+        LOG("cannot watch cgroups, relying on process exits to expire cached ones");
+    }
+}
+
+static void
+start_process_tracking(State *state, pa_mainloop_api *api) {
+    init_process_tree(state);
+    if (state->config.cgroups) {
+        start_cgroup_tracking(state, api);
+    }
+
+    // subscribe before the initial scan, so no fork or exit falls in between
+    int fd = process_events_open();
+    if (fd >= 0) {
+        pa_io_event *e = api->io_new(api, fd, PA_IO_EVENT_INPUT, process_events_callback, state);
+        assert(e);
+    } else {
+        LOG("proc connector unavailable, falling back to periodic rescans");
+        start_process_rescans(state, api);
+    }
+
+    process_tree_rescan(&state->processes);
+}
+
+/**
+ * Volume operation of the replay backend, completed in batches by
+ * `complete_replay_ops`.
+ */
+typedef struct {
+    pa_context_success_cb_t done;
+    void *userdata;
+    bool cancelled;
+} ReplayOp;
+
+typedef struct {
+    ReplayOp *ops;
+    int32_t count;
+    int32_t capacity;
+    int64_t total;
+} ReplayBackend;
+
+static void *
+replay_set_sink_input_volume(AudioBackend *backend, uint32_t index,
+        const pa_cvolume *volume, pa_context_success_cb_t done, void *userdata)
+{
+    (void) index;
+    (void) volume;
+    ReplayBackend *replay = backend->userdata;
+    if (replay->count == replay->capacity) {
+        replay->capacity = replay->capacity ? replay->capacity * 2 : 64;
+        replay->ops = realloc(replay->ops, replay->capacity * sizeof(*replay->ops));
+        assert(replay->ops);
+    }
+    replay->ops[replay->count++] = (ReplayOp) { .done = done, .userdata = userdata };
+    replay->total++;
+    // handles are indices + 1, valid until the batch is completed
+    return (void *) (intptr_t) replay->count;
+}
+
+static void
+replay_release(AudioBackend *backend, void *op) {
+    (void) backend;
+    (void) op;
+}
+
+static void
+replay_cancel(AudioBackend *backend, void *op) {
+    ReplayBackend *replay = backend->userdata;
+    replay->ops[(intptr_t) op - 1].cancelled = true;
+}
+
+/**
+ * Complete all operations, including the ones sent from completions.
+ */
+static void
+complete_replay_ops(ReplayBackend *replay) {
+    for (int32_t i = 0; i < replay->count; i++) {
+        ReplayOp op = replay->ops[i];
+        if (!op.cancelled) {
+            op.done(NULL, 1, op.userdata);
+        }
+    }
+    replay->count = 0;
+}
+
+static void
+ignore_resync(void *userdata) {
+    (void) userdata;
+}
+
+/**
+ * Feed a recorded trace through the engine, with volume operations going to
+ * a backend which completes them right away, and report its throughput.
+ */
+static int
+replay_trace(State *state, const char *path) {
+    TraceReader reader;
+    if (!trace_reader_open(&reader, path)) {
+        fprintf(stderr, "cannot read trace %s\n", path);
+        return 1;
+    }
+
+    ReplayBackend replay = {0};
+    state->backend = (AudioBackend) {
+        .userdata = &replay,
+        .set_sink_input_volume = replay_set_sink_input_volume,
+        .release = replay_release,
+        .cancel = replay_cancel,
+    };
+    // the trace has the timing of the recording, rate limiting doesn't apply
+    state->config.max_update_rate = 0.0f;
+    size_t arena_size = 1024 * 1024;
+    arena_init(&state->temp, calloc(arena_size, 1), arena_size);
+    init_process_tree(state);
+    // the trace has the snapshots of the rescans made while recording,
+    // rather than rescanning the /proc of this machine
+    state->processes.on_resync = ignore_resync;
+
+    int64_t counts[TRACE_PROCESS_EXIT + 1] = {0};
+    int64_t num_records = 0;
+    uint64_t trace_duration = 0;
+    TraceHeader header;
+    const void *payload;
+    bool corrupt = false;
+    uint64_t start = stats_now();
+    while (trace_next(&reader, &header, &payload)) {
+        if (!trace_payload_valid(&header, payload)) {
+            fprintf(stderr, "record %lld of type %u has a payload of the wrong size (%u bytes), stopping\n",
+                    (long long) num_records, header.type, header.size);
+            corrupt = true;
+            break;
+        }
+        num_records++;
+        trace_duration = header.time;
+        if (header.type <= TRACE_PROCESS_EXIT) {
+            counts[header.type]++;
+        }
+
+        switch (header.type) {
+            case TRACE_CONFIGURE: {
+                const TraceConfigure *record = payload;
+                XConfigureEvent conf = {
+                    .type = ConfigureNotify,
+                    .window = record->window,
+                    .x = record->x,
+                    .y = record->y,
+                    .width = record->width,
+                    .height = record->height,
+                };
+                queue_window_update(state, &conf);
+                break;
+            }
+            case TRACE_WINDOW_PID: {
+                const TraceWindowPid *record = payload;
+                set_window_pid(state, get_window_state(state, record->window, true), record->pid, 0);
+                break;
+            }
+            case TRACE_DESTROY: {
+                const TraceWindow *record = payload;
+                remove_window_state(state, record->window);
+                break;
+            }
+            case TRACE_FLUSH:
+                flush_pending_windows(state, NULL, 0);
+                arena_clear(&state->temp);
+                complete_replay_ops(&replay);
+                break;
+            case TRACE_SINK_INPUT: {
+                const TraceSinkInput *record = payload;
+                pa_sink_input_info sii = {
+                    .index = record->index,
+                    .client = PA_INVALID_INDEX,
+                };
+                sii.volume.channels = MIN(record->channels, PA_CHANNELS_MAX);
+                memcpy(sii.volume.values, record->values, sii.volume.channels * sizeof(sii.volume.values[0]));
+                // same path as live, with the PID in the stream's properties
+                if (record->pid > 0) {
+                    sii.proplist = pa_proplist_new();
+                    pa_proplist_setf(sii.proplist, PA_PROP_APPLICATION_PROCESS_ID, "%d", record->pid);
+                }
+                sink_input_info_callback(NULL, &sii, 0, state);
+                if (sii.proplist) {
+                    pa_proplist_free(sii.proplist);
+                }
+                complete_replay_ops(&replay);
+                break;
+            }
+            case TRACE_SINK_INPUT_PID: {
+                const TraceSinkInputPid *record = payload;
+                SinkInput *input = get_sink_input(state, record->index);
+                if (input) {
+                    set_sink_input_pid(state, input, record->pid);
+                }
+                break;
+            }
+            case TRACE_SINK_INPUT_REMOVE: {
+                const TraceSinkInputPid *record = payload;
+                remove_sink_input(state, record->index);
+                break;
+            }
+            case TRACE_PROCESSES: {
+                const uint32_t *count = payload;
+                const pid_t *pids = (const pid_t *) (count + 1);
+                process_tree_load(&state->processes, pids, pids + *count, *count);
+                break;
+            }
+            case TRACE_MONITORS: {
+                const uint32_t *count = payload;
+                const TraceMonitor *records = (const TraceMonitor *) (count + 1);
+                Monitor monitors[LAYOUT_MAX_MONITORS];
+                int32_t num_monitors = MIN(*count, LAYOUT_MAX_MONITORS);
+                for (int32_t i = 0; i < num_monitors; i++) {
+                    monitors[i] = (Monitor) {
+                        .x = records[i].x,
+                        .y = records[i].y,
+                        .width = records[i].width,
+                        .height = records[i].height,
+                    };
+                    memcpy(monitors[i].name, records[i].name, sizeof(monitors[i].name));
+                    monitors[i].name[LAYOUT_MAX_NAME - 1] = '\0';
+                }
+                set_monitors(state, monitors, num_monitors);
+                break;
+            }
+            case TRACE_PROCESS_PARENT: {
+                const TraceProcess *record = payload;
+                process_tree_add(&state->processes, record->pid, record->parent_pid);
+                break;
+            }
+            case TRACE_PROCESS_EXIT: {
+                const TraceProcess *record = payload;
+                process_tree_remove(&state->processes, record->pid);
+                break;
+            }
+            default:
+                break;
+        }
+    }
+    complete_replay_ops(&replay);
+    uint64_t elapsed = stats_now() - start;
+
+    printf("replayed %lld records (%.3f s recorded) in %.3f ms\n",
+            (long long) num_records, trace_duration / 1e9, elapsed / 1e6);
+    printf("  %lld configure, %lld flushes, %lld sink input infos, %lld process snapshots,"
+            " %lld forks and exits\n",
+            (long long) counts[TRACE_CONFIGURE], (long long) counts[TRACE_FLUSH],
+            (long long) counts[TRACE_SINK_INPUT], (long long) counts[TRACE_PROCESSES],
+            (long long) (counts[TRACE_PROCESS_PARENT] + counts[TRACE_PROCESS_EXIT]));
+    printf("  %lld volume operations\n", (long long) replay.total);
+    if (num_records > 0 && elapsed > 0) {
+        printf("  %.1f ns/record, %.0f records/s\n",
+                (double) elapsed / num_records, num_records * 1e9 / elapsed);
+    }
+    if (counts[TRACE_CONFIGURE] > 0) {
+        printf("  %.1f ns/configure event\n", (double) elapsed / counts[TRACE_CONFIGURE]);
+    }
+    stats_dump(stdout);
+
+    trace_reader_close(&reader);
+    free(replay.ops);
+    return corrupt ? 1 : 0;
+}
+
+// load test: synthetic streams per window, windows get their own process
+#define LOAD_TEST_STREAMS_PER_WINDOW 4
+#define LOAD_TEST_FRAME_USEC (4 * PA_USEC_PER_MSEC)
+#define LOAD_TEST_DURATION_USEC (5 * PA_USEC_PER_SEC)
+#define LOAD_TEST_WINDOW_BASE 0x100000
+#define LOAD_TEST_PID_BASE 100000
+
+typedef struct {
+    State *state;
+    int32_t num_windows;
+    int64_t frame;
+    int64_t num_frames;
+    bool done;
+} LoadTest;
+
+/**
+ * Move every window a bit, like a continuous drag, and flush right away.
+ */
+static void
+load_test_frame(pa_mainloop_api *api, pa_time_event *e, const struct timeval *tv, void *userdata) {
+    LoadTest *test = userdata;
+    State *state = test->state;
+    for (int32_t w = 0; w < test->num_windows; w++) {
+        // every window sweeps across two screens, each with its own phase
+        XConfigureEvent conf = {
+            .type = ConfigureNotify,
+            .window = LOAD_TEST_WINDOW_BASE + w,
+            .x = (int) ((test->frame * 16 + w * 97) % 3840) - 100,
+            .width = 200,
+            .height = 100,
+        };
+        queue_window_update(state, &conf);
+    }
+    flush_pending_windows(state, NULL, 0);
+    arena_clear(&state->temp);
+
+    if (++test->frame < test->num_frames) {
+        struct timeval next = *tv;
+        api->time_restart(e, pa_timeval_add(&next, LOAD_TEST_FRAME_USEC));
+    } else {
+        test->done = true;
+        api->time_free(e);
+    }
+}
+
+/**
+ * Drive the engine against an in-process mock server with `num_streams`
+ * sink inputs replying after `latency`, without X, and report how it keeps
+ * up.
+ */
+static int
+load_test(State *state, int32_t num_streams, pa_usec_t latency) {
+    pa_mainloop *ml = pa_mainloop_new();
+    assert(ml);
+    pa_mainloop_api *api = pa_mainloop_get_api(ml);
+    state->main_loop = ml;
+    state->api = api;
+    size_t arena_size = 1024 * 1024;
+    arena_init(&state->temp, calloc(arena_size, 1), arena_size);
+    init_process_tree(state);
+    state->flush_timer = api->time_new(api, NULL, flush_timer_callback, state);
+    assert(state->flush_timer);
+
+    // one process per window, the streams come from children of those
+    int32_t num_windows = (num_streams + LOAD_TEST_STREAMS_PER_WINDOW - 1) / LOAD_TEST_STREAMS_PER_WINDOW;
+    int32_t num_processes = num_windows + num_streams;
+    pid_t *pids = malloc(2 * num_processes * sizeof(*pids));
+    assert(pids);
+    pid_t *parents = pids + num_processes;
+    for (int32_t i = 0; i < num_processes; i++) {
+        pids[i] = LOAD_TEST_PID_BASE + i;
+        parents[i] = i < num_windows ? 1 : LOAD_TEST_PID_BASE + (i - num_windows) % num_windows;
+    }
+    process_tree_load(&state->processes, pids, parents, num_processes);
+
+    MockServer *server = mock_server_new(api, latency);
+    mock_server_init_backend(server, &state->backend);
+    for (int32_t i = 0; i < num_streams; i++) {
+        uint32_t client = mock_server_add_client(server, pids[num_windows + i]);
+        mock_server_add_sink_input(server, client, 2);
+    }
+    free(pids);
+    start_audio(state);
+    for (int32_t w = 0; w < num_windows; w++) {
+        WindowState *ws = get_window_state(state, LOAD_TEST_WINDOW_BASE + w, true);
+        set_window_pid(state, ws, LOAD_TEST_PID_BASE + w, 0);
+    }
+
+    while (state->sink_inputs.count < num_streams) {
+        if (pa_mainloop_iterate(ml, 1, NULL) < 0) {
+            return 1;
+        }
+    }
+
+    LoadTest test = {
+        .state = state,
+        .num_windows = num_windows,
+        .num_frames = LOAD_TEST_DURATION_USEC / LOAD_TEST_FRAME_USEC,
+    };
+    struct timeval tv;
+    api->time_new(api, pa_gettimeofday(&tv), load_test_frame, &test);
+
+    const MockStats *stats = mock_server_stats(server);
+    uint64_t start = stats_now();
+    while (!test.done || stats->in_flight > 0 || state->sink_inputs.deferred_head) {
+        if (pa_mainloop_iterate(ml, 1, NULL) < 0) {
+            return 1;
+        }
+    }
+    uint64_t elapsed = stats_now() - start;
+
+    printf("%d streams on %d windows, %.1f ms reply latency, %lld frames in %.3f s\n",
+            num_streams, num_windows, latency / 1e3, (long long) test.frame, elapsed / 1e9);
+    printf("  %lld volume operations (%.0f/s), at most %d in flight, %lld cancelled\n",
+            (long long) stats->volume_ops, stats->volume_ops * 1e9 / elapsed,
+            stats->max_in_flight, (long long) stats->cancelled_ops);
+    printf("  %lld info requests, %lld events\n",
+            (long long) stats->info_requests, (long long) stats->events);
+    stats_dump(stdout);
+
+    mock_server_free(server);
+    return 0;
+}
+
+static void
+stats_signal_callback(pa_mainloop_api *api, pa_signal_event *event, int signo, void *userdata) {
+    (void) api;
+    (void) event;
+    (void) signo;
+    (void) userdata;
+    stats_dump(stdout);
+}
+
+static void
+quit_reset_callback(pa_context *context, int success, void *userdata) {
+    (void) context;
+    (void) success;
+    State *state = userdata;
+    if (--state->resets_pending == 0) {
+        pa_mainloop_quit(state->main_loop, 0);
+    }
+}
+
+/**
+ * Quit the single-threaded loop on SIGINT or SIGTERM: finish the trace and
+ * give all sink inputs their original volume back, then stop the main loop
+ * once the sound server acknowledged that.
+ */
+static void
+quit_signal_callback(pa_mainloop_api *api, pa_signal_event *event, int signo, void *userdata) {
+    (void) event;
+    (void) signo;
+    State *state = userdata;
+    if (state->quitting) {
+        return;
+    }
+    state->quitting = true;
+    printf("terminating.\n");
+    stats_dump(stdout);
+    trace_writer_close(&state->trace);
+
+    // nothing may change the volumes after they were reset
+    pa_mainloop_set_poll_func(state->main_loop, NULL, NULL);
+    api->time_restart(state->flush_timer, NULL);
+    if (state->sink_inputs.ramp_timer) {
+        api->time_restart(state->sink_inputs.ramp_timer, NULL);
+    }
+
+    if (pa_context_get_state(state->context) == PA_CONTEXT_READY) {
+        for (SinkInputChunk *chunk = state->sink_inputs.chunks; chunk; chunk = chunk->next) {
+            for (int i = 0; i < SINK_INPUT_CHUNK_SIZE; i++) {
+                SinkInput *input = &chunk->slots[i];
+                if (input->sink_input_index == PA_INVALID_INDEX || !input->has_applied_volume) {
+                    continue;
+                }
+                LOGF("resetting volume for sink input %u", input->sink_input_index);
+                pa_operation *op = pa_context_set_sink_input_volume(
+                        state->context,
+                        input->sink_input_index,
+                        &input->true_volume,
+                        quit_reset_callback,
+                        state);
+                if (op) {
+                    state->resets_pending++;
+                    pa_operation_unref(op);
+                }
+            }
+        }
+    }
+    if (state->resets_pending == 0) {
+        pa_mainloop_quit(state->main_loop, 0);
+    }
+}
+
+/**
+ * Handle all X events queued so far, and flush the resulting window
+ * updates. Returns when the next rate-limited window becomes due, or 0.
+ */
+static pa_usec_t
+drain_x_events(State *state) {
+    Display *dsp = state->display;
+    int num_pending = XPending(dsp);
+    Window *mapped = ARENA_ALLOC_ARRAY_EX(&state->temp, Window, num_pending, ARENA_NOZERO);
+    int32_t num_mapped = 0;
+    for (; num_pending > 0; num_pending--) {
+        XEvent event;
+        XNextEvent(dsp, &event);
+        if (event.type == ConfigureNotify) {
+            if (state->trace.file) {
+                TraceConfigure record = {
+                    .window = event.xconfigure.window,
+                    .x = event.xconfigure.x,
+                    .y = event.xconfigure.y,
+                    .width = event.xconfigure.width,
+                    .height = event.xconfigure.height,
+                };
+                trace_write(&state->trace, TRACE_CONFIGURE, &record, sizeof(record));
+            }
+            queue_window_update(state, &event.xconfigure);
+        } else if (event.type == MapNotify) {
+            // resolve the PID now rather than on the first move
+            if (!event.xmap.override_redirect) {
+                get_window_state(state, event.xmap.window, true);
+                mapped[num_mapped++] = event.xmap.window;
+            }
+        } else if (event.type == ReparentNotify) {
+            // the new parent may get its PID from this window now
+            invalidate_window_pid(state, event.xreparent.parent);
+        } else if (event.type == PropertyNotify) {
+            if (event.xproperty.atom == state->atoms.net_wm_pid) {
+                invalidate_window_pid(state, event.xproperty.window);
+            }
+        } else if (event.type == DestroyNotify) {
+            record_window(state, TRACE_DESTROY, event.xdestroywindow.window);
+            remove_window_state(state, event.xdestroywindow.window);
+        } else if (state->randr_event_base >= 0
+                && event.type == state->randr_event_base + RRScreenChangeNotify) {
+            // monitors were added, removed, moved or rotated
+            XRRUpdateConfiguration(&event);
+            query_monitors(state);
+        }
+    }
+    pa_usec_t next_due = flush_pending_windows(state, mapped, num_mapped);
+    arena_clear(&state->temp);
+    return next_due;
+}
+
+/**
+ * Runs on the sound server thread whenever the other stages pushed
+ * something: applies the newest process snapshot, then all balance updates.
+ */
+static void
+pipeline_wakeup_callback(pa_mainloop_api *api, pa_io_event *e, int fd, pa_io_event_flags_t events, void *userdata) {
+    (void) api;
+    (void) e;
+    (void) events;
+    State *state = userdata;
+    Pipeline *pipeline = state->pipeline;
+    uint64_t count;
+    ssize_t ret = read(fd, &count, sizeof(count));
+    (void) ret;
+
+    ProcessSnapshot latest = { NULL, 0 };
+    ProcessSnapshot snapshot;
+    while (ring_pop(&pipeline->snapshots, &snapshot)) {
+        free(latest.pids);
+        latest = snapshot;
+    }
+    if (latest.pids) {
+        process_tree_load(&state->processes, latest.pids, latest.pids + latest.count, latest.count);
+        free(latest.pids);
+    }
+
+    PanRequest request;
+    while (ring_pop(&pipeline->pans, &request)) {
+        pan_pid(state, request.pid, &request.motion, request.received_at);
+    }
+}
+
+static Pipeline *
+pipeline_new(State *state) {
+    Pipeline *pipeline = calloc(1, sizeof(*pipeline));
+    assert(pipeline);
+    pipeline->main_loop = pa_threaded_mainloop_new();
+    assert(pipeline->main_loop);
+    bool ok = ring_init(&pipeline->pans, PIPELINE_PAN_CAPACITY, sizeof(PanRequest));
+    ok = ok && ring_init(&pipeline->snapshots, PIPELINE_SNAPSHOT_CAPACITY, sizeof(ProcessSnapshot));
+    assert(ok);
+    pipeline->wakeup_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    assert(pipeline->wakeup_fd >= 0);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&pipeline->resolver_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&pipeline->resolver_lock, NULL);
+
+    pa_mainloop_api *api = pa_threaded_mainloop_get_api(pipeline->main_loop);
+    pa_io_event *e = api->io_new(api, pipeline->wakeup_fd, PA_IO_EVENT_INPUT, pipeline_wakeup_callback, state);
+    assert(e);
+    return pipeline;
+}
+
+static volatile sig_atomic_t quit_requested = 0;
+
+static void
+request_quit(int signo) {
+    (void) signo;
+    quit_requested = 1;
+}
+
+/**
+ * Threads inherit the signal mask, so blocking SIGINT and SIGTERM before
+ * the other stages start makes sure they end up with the X thread. That one
+ * keeps them blocked too and only accepts them atomically while waiting in
+ * ppoll, so a signal can't slip in between checking `quit_requested` and
+ * going to sleep.
+ */
+static void
+block_quit_signals(void) {
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+}
+
+static void
+reset_volume_callback(pa_context *context, int success, void *userdata) {
+    (void) context;
+    (void) success;
+    Pipeline *pipeline = userdata;
+    pipeline->resets_pending--;
+    pa_threaded_mainloop_signal(pipeline->main_loop, 0);
+}
+
+/**
+ * Give all sink inputs their original volume back before exiting.
+ */
+static void
+reset_volumes(State *state) {
+    Pipeline *pipeline = state->pipeline;
+    pa_threaded_mainloop_lock(pipeline->main_loop);
+    if (pa_context_get_state(state->context) == PA_CONTEXT_READY) {
+        for (SinkInputChunk *chunk = state->sink_inputs.chunks; chunk; chunk = chunk->next) {
+            for (int i = 0; i < SINK_INPUT_CHUNK_SIZE; i++) {
+                SinkInput *input = &chunk->slots[i];
+                if (input->sink_input_index == PA_INVALID_INDEX || !input->has_applied_volume) {
+                    continue;
+                }
+                pa_operation *op = pa_context_set_sink_input_volume(
+                        state->context,
+                        input->sink_input_index,
+                        &input->true_volume,
+                        reset_volume_callback,
+                        pipeline);
+                if (op) {
+                    pipeline->resets_pending++;
+                    pa_operation_unref(op);
+                }
+            }
+        }
+        while (pipeline->resets_pending > 0 && pa_context_get_state(state->context) == PA_CONTEXT_READY) {
+            pa_threaded_mainloop_wait(pipeline->main_loop);
+        }
+        pa_context_disconnect(state->context);
+    }
+    pa_threaded_mainloop_unlock(pipeline->main_loop);
+    pa_threaded_mainloop_stop(pipeline->main_loop);
+}
+
+/**
+ * Run the threaded pipeline until SIGINT or SIGTERM, with the calling
+ * thread as the X stage.
+ */
+static void
+run_pipeline(State *state) {
+    Pipeline *pipeline = state->pipeline;
+    int error = pa_threaded_mainloop_start(pipeline->main_loop);
+    assert(error == 0);
+
+    // the quit signals stay blocked except while sleeping in ppoll
+    sigset_t wait_mask;
+    pthread_sigmask(SIG_SETMASK, NULL, &wait_mask);
+    sigdelset(&wait_mask, SIGINT);
+    sigdelset(&wait_mask, SIGTERM);
+
+    Display *dsp = state->display;
+    struct pollfd fd = {
+        .fd = ConnectionNumber(dsp),
+        .events = POLLIN,
+    };
+    while (!quit_requested) {
+        pa_usec_t next_due = drain_x_events(state);
+        // this also flushes our pending requests before we go to sleep
+        if (XEventsQueued(dsp, QueuedAfterFlush) > 0) {
+            continue;
+        }
+        struct timespec timeout = { 0, 0 };
+        if (next_due) {
+            pa_usec_t now = pa_rtclock_now();
+            pa_usec_t wait = next_due > now ? next_due - now : 0;
+            timeout.tv_sec = wait / PA_USEC_PER_SEC;
+            timeout.tv_nsec = (wait % PA_USEC_PER_SEC) * 1000;
+        }
+        ppoll(&fd, 1, next_due ? &timeout : NULL, &wait_mask);
+    }
+
+    printf("terminating.\n");
+    stats_dump(stdout);
+    reset_volumes(state);
+}
+
+static void
+usage(const char *argv0) {
+    fprintf(stderr,
+            "usage: %s [-r RATE] [-s MAPPING] [-P] [-R RATE] [-c] [-w TRACE | -p TRACE | -m STREAMS[:LATENCY_MS]]\n"
+            "  -r RATE   limit balance updates to RATE per second and window (default: no limit)\n"
+            "  -s NAME=LEFT:RIGHT[,...]\n"
+            "            pan windows on monitor NAME (e.g. DP-1) from balance LEFT to RIGHT,\n"
+            "            0 being left and 1 right, instead of across the whole desktop\n"
+            "  -P        pan moving windows ahead by the latency of each stream\n"
+            "  -R RATE   ramp volume changes in steps at RATE per second (e.g. 60) instead of\n"
+            "            jumping, with at most one batch of volume operations per step\n"
+            "  -c        match windows to streams of the same systemd scope or service, and\n"
+            "            by process ancestry only for those in shared cgroups\n"
+            "  -w TRACE  record X, sink input and process events to TRACE; runs all stages\n"
+            "            on one thread instead of the threaded pipeline\n"
+            "  -p TRACE  replay TRACE without X or a sound server and report throughput\n"
+            "  -m STREAMS[:LATENCY_MS]\n"
+            "            load test against a simulated sound server with STREAMS sink inputs\n",
+            argv0);
+}
+
+int
+main(int argc, char **argv) {
+    State *state = malloc(sizeof(*state));
+    state_init(state);
+
+    const char *record_path = NULL;
+    const char *replay_path = NULL;
+    int32_t mock_streams = 0;
+    pa_usec_t mock_latency = 0;
+    char *end;
+    int opt;
+    while ((opt = getopt(argc, argv, "r:s:PR:cw:p:m:h")) != -1) {
+        switch (opt) {
+            case 'r':
+                state->config.max_update_rate = strtof(optarg, NULL);
+                break;
+            case 'P':
+                state->config.predict = true;
+                break;
+            case 'R':
+                state->config.ramp_rate = strtof(optarg, NULL);
+                break;
+            case 'c':
+                state->config.cgroups = true;
+                break;
+            case 's':
+                if (!layout_parse_mappings(&state->layout, optarg)) {
+                    usage(argv[0]);
+                    return 2;
+                }
+                break;
+            case 'w':
+                record_path = optarg;
+                break;
+            case 'p':
+                replay_path = optarg;
+                break;
+            case 'm':
+                mock_streams = strtol(optarg, &end, 10);
+                if (*end == ':') {
+                    mock_latency = (pa_usec_t) (strtod(end + 1, NULL) * PA_USEC_PER_MSEC);
+                }
+                if (mock_streams <= 0) {
+                    usage(argv[0]);
+                    return 2;
+                }
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 2;
+        }
+    }
+
+    if (replay_path) {
+        return replay_trace(state, replay_path);
+    }
+    if (mock_streams) {
+        return load_test(state, mock_streams, mock_latency);
+    }
+    if (record_path && !trace_writer_open(&state->trace, record_path)) {
+        fprintf(stderr, "cannot create trace %s\n", record_path);
+        return 1;
+    }
+
+    // recordings need the single-threaded loop, which sees all events in
+    // one order
+    bool threaded = !record_path;
+    pa_mainloop *ml = NULL;
+    if (threaded) {
+        state->pipeline = pipeline_new(state);
+        state->api = pa_threaded_mainloop_get_api(state->pipeline->main_loop);
+        signal(SIGINT, request_quit);
+        signal(SIGTERM, request_quit);
+        block_quit_signals();
+    } else {
+        ml = pa_mainloop_new();
+        assert(ml);
+        state->main_loop = ml;
+        state->api = pa_mainloop_get_api(ml);
+    }
+    pa_mainloop_api *ml_api = state->api;
+    assert(ml_api);
+
+    // dump latency histograms on demand and quit the single-threaded loop,
+    // through the main loop rather than from a signal handler
+    if (pa_signal_init(ml_api) == 0) {
+        pa_signal_new(SIGUSR1, stats_signal_callback, NULL);
+        if (!threaded) {
+            pa_signal_new(SIGINT, quit_signal_callback, state);
+            pa_signal_new(SIGTERM, quit_signal_callback, state);
+        }
+    }
+
+    pa_context *context = pa_context_new(ml_api, "helloworld");
+    assert(context);
+
+    pa_context_set_state_callback(context, context_state_callback, state);
+    assert(pa_context_connect(context, NULL, 0, NULL) >= 0);
+
+    state->context = context;
+    init_pulse_backend(&state->backend, context);
+
+    start_process_tracking(state, ml_api);
+
+    // ------------------------------------------------------------
 
-    Arena temp;
     size_t arena_size = 1024 * 1024;
     void *memory = calloc(arena_size, 1);
-    arena_init(&temp, memory, arena_size);
+    arena_init(&state->temp, memory, arena_size);
 
     Display *dsp = XOpenDisplay(NULL);
     assert(dsp);
     // TODO: close display on exit?
+    state->display = dsp;
+    XSetErrorHandler(x_error_handler);
+
+    state->xcb = XGetXCBConnection(dsp);
+    intern_atoms(state->xcb, &state->atoms);
+
+    if (!threaded) {
+        state->flush_timer = ml_api->time_new(ml_api, NULL, flush_timer_callback, state);
+        assert(state->flush_timer);
+    }
 
     Window root = DefaultRootWindow(dsp);
     assert(root);
+    state->root = root;
 
     int status = XSelectInput(dsp, root, SubstructureNotifyMask);
     printf("status = %d\n", status);
 
+    int randr_error_base;
+    if (XRRQueryExtension(dsp, &state->randr_event_base, &randr_error_base)) {
+        XRRSelectInput(dsp, root, RRScreenChangeNotifyMask);
+    } else {
+        state->randr_event_base = -1;
+    }
+    query_monitors(state);
+
+    if (threaded) {
+        run_pipeline(state);
+        return 0;
+    }
+
+    pa_mainloop_set_poll_func(ml, poll_with_display, dsp);
+
     for (;;) {
-        for (int num_pending = XPending(dsp); num_pending > 0; num_pending--) {
-            XEvent event;
-            XNextEvent(dsp, &event);
-            if (event.type == ConfigureNotify) {
-                XConfigureEvent *conf = &event.xconfigure;
-                pid_t pid = find_window_pid(dsp, conf->window);
-                adjust_volume(state, context, pid, *conf, &temp);
-            }
+        if (!state->quitting) {
+            drain_x_events(state);
+        } else if (pa_context_get_state(context) != PA_CONTEXT_READY) {
+            // the resets won't be acknowledged anymore
+            break;
         }
-        arena_clear(&temp);
 
-        pa_mainloop_iterate(ml, 0, NULL);
+        // blocks until there are X events, PulseAudio replies or due timers
+        if (pa_mainloop_iterate(ml, 1, NULL) < 0) {
+            LOG("PulseAudio main loop quit");
+            break;
+        }
+    }
+
+    if (!state->quitting) {
+        return 1;
     }
+    pa_context_disconnect(context);
+    return 0;
 }
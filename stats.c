@@ -0,0 +1,106 @@
+#include <stdatomic.h>
+#include <time.h>
+
+#include "stats.h"
+
+typedef struct {
+    _Atomic uint64_t buckets[STATS_NUM_BUCKETS];
+    _Atomic uint64_t count;
+    _Atomic uint64_t sum;
+    _Atomic uint64_t max;
+} Histogram;
+
+static Histogram histograms[NUM_STAGES];
+
+static const char *stage_names[NUM_STAGES] = {
+    [STAGE_QUEUED] = "queued",
+    [STAGE_PID_RESOLVE] = "pid_resolve",
+    [STAGE_DESCENDANTS] = "descendants",
+    [STAGE_MATCH] = "match",
+    [STAGE_SUBMIT] = "submit",
+    [STAGE_APPLY] = "apply",
+    [STAGE_END_TO_END] = "end_to_end",
+};
+
+uint64_t
+stats_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+bucket_of(uint64_t nanoseconds) {
+    int bucket = nanoseconds ? 63 - __builtin_clzll(nanoseconds) : 0;
+    return bucket < STATS_NUM_BUCKETS ? bucket : STATS_NUM_BUCKETS - 1;
+}
+
+void
+stats_record(Stage stage, uint64_t nanoseconds) {
+    // the counters are independent, a dump may see them slightly out of sync
+    Histogram *histogram = &histograms[stage];
+    atomic_fetch_add_explicit(&histogram->buckets[bucket_of(nanoseconds)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->sum, nanoseconds, memory_order_relaxed);
+
+    uint64_t max = atomic_load_explicit(&histogram->max, memory_order_relaxed);
+    while (nanoseconds > max
+            && !atomic_compare_exchange_weak_explicit(&histogram->max, &max, nanoseconds,
+                memory_order_relaxed, memory_order_relaxed))
+    {
+    }
+}
+
+/**
+ * Upper bound of the bucket containing the `fraction` quantile, but at most
+ * the largest sample.
+ */
+static uint64_t
+percentile(const uint64_t *buckets, uint64_t count, uint64_t max, double fraction) {
+    uint64_t rank = (uint64_t) (fraction * count);
+    uint64_t seen = 0;
+    for (int i = 0; i < STATS_NUM_BUCKETS; i++) {
+        seen += buckets[i];
+        if (seen > rank) {
+            uint64_t bound = (uint64_t) 2 << i;
+            return bound < max ? bound : max;
+        }
+    }
+    return max;
+}
+
+void
+stats_dump(FILE *out) {
+    fprintf(out, "%-12s %10s %10s %10s %10s %10s %10s\n",
+            "stage", "count", "mean_us", "p50_us", "p99_us", "p999_us", "max_us");
+    for (int stage = 0; stage < NUM_STAGES; stage++) {
+        Histogram *histogram = &histograms[stage];
+        uint64_t buckets[STATS_NUM_BUCKETS];
+        uint64_t count = 0;
+        for (int i = 0; i < STATS_NUM_BUCKETS; i++) {
+            buckets[i] = atomic_load_explicit(&histogram->buckets[i], memory_order_relaxed);
+            count += buckets[i];
+        }
+        if (!count) {
+            continue;
+        }
+        uint64_t sum = atomic_load_explicit(&histogram->sum, memory_order_relaxed);
+        uint64_t max = atomic_load_explicit(&histogram->max, memory_order_relaxed);
+
+        fprintf(out, "%-12s %10llu %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+                stage_names[stage],
+                (unsigned long long) count,
+                sum / 1e3 / count,
+                percentile(buckets, count, max, 0.5) / 1e3,
+                percentile(buckets, count, max, 0.99) / 1e3,
+                percentile(buckets, count, max, 0.999) / 1e3,
+                max / 1e3);
+        for (int i = 0; i < STATS_NUM_BUCKETS; i++) {
+            if (buckets[i]) {
+                fprintf(out, "    < %12llu ns: %llu\n",
+                        (unsigned long long) 2 << i, (unsigned long long) buckets[i]);
+            }
+        }
+    }
+    fflush(out);
+}
@@ -0,0 +1,56 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * Stages of a balance update, from the X event to the volume being applied
+ * by the server. Each one feeds its own latency histogram.
+ */
+typedef enum {
+    // ConfigureNotify received -> flushed, i.e. coalescing and rate limiting
+    STAGE_QUEUED,
+    // resolving the PIDs of one batch of windows
+    STAGE_PID_RESOLVE,
+    // looking up the sink inputs of a PID and of its descendants
+    STAGE_DESCENDANTS,
+    // matching those sink inputs to volumes and requesting them
+    STAGE_MATCH,
+    // ConfigureNotify received -> volume operation submitted
+    STAGE_SUBMIT,
+    // volume operation submitted -> success callback
+    STAGE_APPLY,
+    // ConfigureNotify received -> success callback
+    STAGE_END_TO_END,
+    NUM_STAGES,
+} Stage;
+
+// bucket i counts latencies in [2^i, 2^(i+1)) ns, the last one everything above
+#define STATS_NUM_BUCKETS 40
+
+/**
+ * Monotonic timestamp in nanoseconds.
+ */
+uint64_t stats_now(void);
+
+/**
+ * Add one latency sample to the histogram of `stage`. Lock-free, so it may
+ * be called from any thread.
+ */
+void stats_record(Stage stage, uint64_t nanoseconds);
+
+static inline void
+stats_record_since(Stage stage, uint64_t start) {
+    if (start) {
+        stats_record(stage, stats_now() - start);
+    }
+}
+
+/**
+ * Print count, mean, max, approximate percentiles and the non-empty buckets
+ * of every stage with samples.
+ */
+void stats_dump(FILE *out);
+
+#endif /* STATS_H */
@@ -0,0 +1,143 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "stats.h"
+#include "trace.h"
+
+bool
+trace_writer_open(TraceWriter *writer, const char *path) {
+    writer->file = fopen(path, "wb");
+    if (!writer->file) {
+        return false;
+    }
+    // records are small, let stdio batch them
+    setvbuf(writer->file, NULL, _IOFBF, 1 << 16);
+    fwrite(TRACE_MAGIC, 1, strlen(TRACE_MAGIC), writer->file);
+    writer->start = stats_now();
+    return true;
+}
+
+void
+trace_writer_close(TraceWriter *writer) {
+    if (writer->file) {
+        fclose(writer->file);
+        writer->file = NULL;
+    }
+}
+
+void
+trace_begin(TraceWriter *writer, TraceType type, uint32_t size) {
+    TraceHeader header = {
+        .time = stats_now() - writer->start,
+        .type = type,
+        .size = size,
+    };
+    fwrite(&header, sizeof(header), 1, writer->file);
+}
+
+void
+trace_append(TraceWriter *writer, const void *data, uint32_t size) {
+    if (size) {
+        fwrite(data, size, 1, writer->file);
+    }
+}
+
+void
+trace_write(TraceWriter *writer, TraceType type, const void *payload, uint32_t size) {
+    trace_begin(writer, type, size);
+    trace_append(writer, payload, size);
+}
+
+bool
+trace_reader_open(TraceReader *reader, const char *path) {
+    memset(reader, 0, sizeof(*reader));
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        return false;
+    }
+
+    size_t capacity = 1 << 20;
+    uint8_t *data = malloc(capacity);
+    size_t size = 0;
+    size_t n;
+    while (data && (n = fread(data + size, 1, capacity - size, file)) > 0) {
+        size += n;
+        if (size == capacity) {
+            capacity *= 2;
+            uint8_t *grown = realloc(data, capacity);
+            if (!grown) {
+                free(data);
+            }
+            data = grown;
+        }
+    }
+    fclose(file);
+
+    size_t magic_len = strlen(TRACE_MAGIC);
+    if (!data || size < magic_len || memcmp(data, TRACE_MAGIC, magic_len) != 0) {
+        free(data);
+        return false;
+    }
+    reader->data = data;
+    reader->size = size;
+    reader->offset = magic_len;
+    return true;
+}
+
+void
+trace_reader_close(TraceReader *reader) {
+    free(reader->data);
+    memset(reader, 0, sizeof(*reader));
+}
+
+bool
+trace_next(TraceReader *reader, TraceHeader *header, const void **payload) {
+    if (reader->size - reader->offset < sizeof(*header)) {
+        return false;
+    }
+    memcpy(header, reader->data + reader->offset, sizeof(*header));
+    if (reader->size - reader->offset - sizeof(*header) < header->size) {
+        return false;
+    }
+    *payload = reader->data + reader->offset + sizeof(*header);
+    reader->offset += sizeof(*header) + header->size;
+    return true;
+}
+
+bool
+trace_payload_valid(const TraceHeader *header, const void *payload) {
+    uint64_t size = header->size;
+    switch (header->type) {
+        case TRACE_CONFIGURE:
+            return size >= sizeof(TraceConfigure);
+        case TRACE_WINDOW_PID:
+            return size >= sizeof(TraceWindowPid);
+        case TRACE_DESTROY:
+            return size >= sizeof(TraceWindow);
+        case TRACE_SINK_INPUT_PID:
+        case TRACE_SINK_INPUT_REMOVE:
+            return size >= sizeof(TraceSinkInputPid);
+        case TRACE_PROCESS_PARENT:
+        case TRACE_PROCESS_EXIT:
+            return size >= sizeof(TraceProcess);
+        case TRACE_SINK_INPUT: {
+            if (size < sizeof(TraceSinkInput)) {
+                return false;
+            }
+            const TraceSinkInput *record = payload;
+            return size == sizeof(TraceSinkInput) + (uint64_t) record->channels * sizeof(record->values[0]);
+        }
+        case TRACE_PROCESSES:
+        case TRACE_MONITORS: {
+            uint32_t count;
+            if (size < sizeof(count)) {
+                return false;
+            }
+            memcpy(&count, payload, sizeof(count));
+            uint64_t element_size = header->type == TRACE_PROCESSES ? 2 * sizeof(int32_t) : sizeof(TraceMonitor);
+            return size == sizeof(count) + count * element_size;
+        }
+        default:
+            return true;
+    }
+}
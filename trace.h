@@ -0,0 +1,144 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Binary traces of the events driving the panning engine, for replaying
+ * them without an X server or sound server. A trace is the magic followed by
+ * records, each a TraceHeader and `size` bytes of payload, in host byte
+ * order.
+ */
+
+#define TRACE_MAGIC "PWSTRC01"
+
+typedef enum {
+    // TraceConfigure
+    TRACE_CONFIGURE = 1,
+    // TraceWindowPid, result of resolving the PID of a window
+    TRACE_WINDOW_PID,
+    // TraceWindow
+    TRACE_DESTROY,
+    // no payload, end of a batch of X events
+    TRACE_FLUSH,
+    // TraceSinkInput, a sink input info reply
+    TRACE_SINK_INPUT,
+    // TraceSinkInputPid, PID of a sink input resolved after the fact
+    TRACE_SINK_INPUT_PID,
+    // TraceSinkInputPid with pid == -1
+    TRACE_SINK_INPUT_REMOVE,
+    // uint32_t count, then `count` PIDs and `count` parent PIDs; the whole
+    // process tree, at startup and after rescans
+    TRACE_PROCESSES,
+    // uint32_t count, then `count` TraceMonitors, the whole new layout
+    TRACE_MONITORS,
+    // TraceProcess, a process forked or, after its parent exited, got
+    // reparented
+    TRACE_PROCESS_PARENT,
+    // TraceProcess with parent_pid == -1, after its orphans were reparented
+    TRACE_PROCESS_EXIT,
+} TraceType;
+
+typedef struct {
+    // nanoseconds since the start of the recording
+    uint64_t time;
+    uint32_t type;
+    uint32_t size;
+} TraceHeader;
+
+typedef struct {
+    uint32_t window;
+    int32_t x;
+    int32_t y;
+    int32_t width;
+    int32_t height;
+} TraceConfigure;
+
+typedef struct {
+    uint32_t window;
+    int32_t pid;
+} TraceWindowPid;
+
+typedef struct {
+    uint32_t window;
+} TraceWindow;
+
+typedef struct {
+    uint32_t index;
+    int32_t pid;
+    uint32_t channels;
+    // only `channels` values are stored
+    uint32_t values[];
+} TraceSinkInput;
+
+typedef struct {
+    uint32_t index;
+    int32_t pid;
+} TraceSinkInputPid;
+
+typedef struct {
+    int32_t x;
+    int32_t y;
+    int32_t width;
+    int32_t height;
+    char name[32];
+} TraceMonitor;
+
+typedef struct {
+    int32_t pid;
+    int32_t parent_pid;
+} TraceProcess;
+
+typedef struct {
+    FILE *file;
+    uint64_t start;
+} TraceWriter;
+
+/**
+ * Create the trace file at `path`. Returns false on failure.
+ */
+bool trace_writer_open(TraceWriter *writer, const char *path);
+void trace_writer_close(TraceWriter *writer);
+
+/**
+ * Start a record with a payload of `size` bytes, which must then be written
+ * with `trace_append`.
+ */
+void trace_begin(TraceWriter *writer, TraceType type, uint32_t size);
+void trace_append(TraceWriter *writer, const void *data, uint32_t size);
+
+/**
+ * Write a record whose payload is `size` bytes at `payload`.
+ */
+void trace_write(TraceWriter *writer, TraceType type, const void *payload, uint32_t size);
+
+typedef struct {
+    uint8_t *data;
+    size_t size;
+    size_t offset;
+} TraceReader;
+
+/**
+ * Read the whole trace at `path` into memory. Returns false if it can't be
+ * read or isn't a trace.
+ */
+bool trace_reader_open(TraceReader *reader, const char *path);
+void trace_reader_close(TraceReader *reader);
+
+/**
+ * Advance to the next record, returns false at the end of the trace or on a
+ * truncated record.
+ */
+bool trace_next(TraceReader *reader, TraceHeader *header, const void **payload);
+
+/**
+ * Whether the payload of a record is as large as its type requires,
+ * including the variable-length parts announced by its counts. Records of
+ * unknown types are accepted, so that readers can skip them.
+ */
+bool trace_payload_valid(const TraceHeader *header, const void *payload);
+
+#endif /* TRACE_H */